@@ -6,9 +6,42 @@
 // Description : Hello World in C++, Ansi-style
 //============================================================================
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
 #include <time.h>
 #include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/resource.h>
+#include <unistd.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+/// AVX2 kernels are compiled per function and picked at run time, so the
+/// default x86-64 build still uses them on CPUs that have AVX2
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AVX2_KERNELS 1
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "CSVparser.hpp"
 
@@ -20,6 +53,12 @@ using namespace std;
 
 // forward declarations
 double strToDouble(string str, char ch);
+bool reportBadRow(unsigned int line, const string& reason);
+struct Bid;
+Bid parseBid(const csv::Row& row);
+struct AmountSummary;
+AmountSummary summarizeAmounts(const double* amounts, size_t count);
+vector<size_t> histogramAmounts(const double* amounts, size_t count, double low, double high, int bucketCount);
 
 // define a structure to hold bid information
 struct Bid {
@@ -37,17 +76,597 @@ struct Node {
     Bid bid;
     Node *left;
     Node *right;
+    double subtreeTotal; // sum of amounts in this subtree
+    int subtreeCount;    // number of bids in this subtree
 
     // default constructor
     Node() {
         left = nullptr;
         right = nullptr;
+        subtreeTotal = 0.0;
+        subtreeCount = 0;
     }
 
     // initialize with a bid
     Node(Bid aBid) : Node() {
         this->bid = aBid;
+        subtreeTotal = aBid.amount;
+        subtreeCount = 1;
+    }
+};
+
+// Count, total and extremes of a set of amounts
+struct AmountSummary {
+    size_t count;
+    double total;
+    double min;
+    double max;
+
+    AmountSummary() {
+        count = 0;
+        total = 0.0;
+        min = numeric_limits<double>::infinity();
+        max = -numeric_limits<double>::infinity();
+    }
+
+    void Add(double amount) {
+        count++;
+        total += amount;
+        if (amount < min)
+            min = amount;
+        if (amount > max)
+            max = amount;
+    }
+
+    double Average() const {
+        return count == 0 ? 0.0 : total / count;
+    }
+};
+
+// Amount aggregates over a set of bids: overall, per fund, and a histogram
+struct AmountReport {
+    AmountSummary overall;
+    map<string, AmountSummary> byFund;
+    vector<size_t> histogram; // buckets split [overall.min, overall.max] evenly
+};
+
+//============================================================================
+// Hash index class definition
+//============================================================================
+
+/**
+ * Open-addressing hash index from bidId to tree node
+ *
+ * Slots are split into groups of 16 with one control byte per slot. A
+ * control byte is either EMPTY, DELETED or the low 7 bits of the key's
+ * hash, so a lookup compares a whole group of control bytes at once
+ * (SSE2 when available) and only follows the node pointer on a match.
+ */
+class BidIndex {
+
+private:
+    static const size_t GROUP_WIDTH = 16;
+    static const int8_t EMPTY = -128;
+    static const int8_t DELETED = -2;
+
+    int8_t* ctrl;
+    Node** slots;
+    size_t capacity;
+    size_t count;
+    size_t tombstones;
+
+    uint32_t matchGroup(const int8_t* group, int8_t h2) const;
+    uint32_t matchFree(const int8_t* group) const;
+    size_t findSlot(const string& bidId, size_t hash) const;
+    void rehash(size_t newCapacity);
+
+public:
+    BidIndex();
+    virtual ~BidIndex();
+    Node* Find(const string& bidId) const;
+    bool Insert(const string& bidId, Node* node);
+    void Assign(const string& bidId, Node* node);
+    bool Erase(const string& bidId);
+    size_t GetSize() const;
+};
+
+/**
+ * Default constructor
+ */
+BidIndex::BidIndex() {
+    ctrl = nullptr;
+    slots = nullptr;
+    capacity = 0;
+    count = 0;
+    tombstones = 0;
+}
+
+/**
+ * Destructor
+ *
+ * The index never owns the nodes it points to.
+ */
+BidIndex::~BidIndex() {
+    delete[] ctrl;
+    delete[] slots;
+}
+
+/**
+ * Bitmask of the slots in a group whose control byte equals h2
+ *
+ * @param group First control byte of the group
+ * @param h2 Control byte to look for
+ */
+uint32_t BidIndex::matchGroup(const int8_t* group, int8_t h2) const {
+#if defined(__SSE2__)
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(h2)));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < GROUP_WIDTH; i++) {
+        if (group[i] == h2)
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+/**
+ * Bitmask of the slots in a group that are EMPTY or DELETED
+ *
+ * @param group First control byte of the group
+ */
+uint32_t BidIndex::matchFree(const int8_t* group) const {
+#if defined(__SSE2__)
+    /// Both EMPTY and DELETED have the sign bit set, hashes never do
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+    return _mm_movemask_epi8(bytes);
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < GROUP_WIDTH; i++) {
+        if (group[i] < 0)
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+/**
+ * Find the slot holding bidId, or capacity if it is not indexed
+ *
+ * @param bidId The key to look for
+ * @param hash The full hash of bidId
+ */
+size_t BidIndex::findSlot(const string& bidId, size_t hash) const {
+    if (capacity == 0)
+        return capacity;
+
+    size_t groupMask = capacity / GROUP_WIDTH - 1;
+    size_t group = (hash >> 7) & groupMask;
+    int8_t h2 = hash & 0x7f;
+
+    /// Triangular probing visits every group once when the group count is a power of two
+    for (size_t step = 1; step <= groupMask + 1; step++) {
+        const int8_t* base = ctrl + group * GROUP_WIDTH;
+        uint32_t match = matchGroup(base, h2);
+        while (match != 0) {
+            size_t slot = group * GROUP_WIDTH + __builtin_ctz(match);
+            if (slots[slot]->bid.bidId == bidId)
+                return slot;
+            match &= match - 1;
+        }
+        /// An empty slot ends the probe sequence
+        if (matchGroup(base, EMPTY) != 0)
+            return capacity;
+        group = (group + step) & groupMask;
+    }
+    return capacity;
+}
+
+/**
+ * Move every live entry into a fresh table
+ *
+ * @param newCapacity Slot count of the new table, a power of two
+ */
+void BidIndex::rehash(size_t newCapacity) {
+    int8_t* oldCtrl = ctrl;
+    Node** oldSlots = slots;
+    size_t oldCapacity = capacity;
+
+    ctrl = new int8_t[newCapacity];
+    slots = new Node*[newCapacity];
+    for (size_t i = 0; i < newCapacity; i++)
+        ctrl[i] = EMPTY;
+    capacity = newCapacity;
+    count = 0;
+    tombstones = 0;
+
+    for (size_t i = 0; i < oldCapacity; i++) {
+        if (oldCtrl[i] >= 0)
+            Insert(oldSlots[i]->bid.bidId, oldSlots[i]);
+    }
+
+    delete[] oldCtrl;
+    delete[] oldSlots;
+}
+
+/**
+ * Look up the node for a bidId
+ *
+ * @param bidId The key to look for
+ */
+Node* BidIndex::Find(const string& bidId) const {
+    size_t slot = findSlot(bidId, std::hash<string>()(bidId));
+    if (slot == capacity)
+        return nullptr;
+    return slots[slot];
+}
+
+/**
+ * Index a node unless its bidId is already present
+ *
+ * @param bidId The node's key
+ * @param node The node to index
+ * return true if the node was added
+ */
+bool BidIndex::Insert(const string& bidId, Node* node) {
+    size_t hash = std::hash<string>()(bidId);
+    if (findSlot(bidId, hash) != capacity)
+        return false;
+
+    /// Keep the table at most 7/8 full, counting tombstones
+    if ((count + tombstones + 1) * 8 > capacity * 7) {
+        size_t newCapacity = capacity == 0 ? GROUP_WIDTH : capacity;
+        if ((count + 1) * 2 > newCapacity)
+            newCapacity *= 2;
+        rehash(newCapacity);
+    }
+
+    size_t groupMask = capacity / GROUP_WIDTH - 1;
+    size_t group = (hash >> 7) & groupMask;
+    for (size_t step = 1; ; step++) {
+        uint32_t vacant = matchFree(ctrl + group * GROUP_WIDTH);
+        if (vacant != 0) {
+            size_t slot = group * GROUP_WIDTH + __builtin_ctz(vacant);
+            if (ctrl[slot] == DELETED)
+                tombstones--;
+            ctrl[slot] = hash & 0x7f;
+            slots[slot] = node;
+            count++;
+            return true;
+        }
+        group = (group + step) & groupMask;
+    }
+}
+
+/**
+ * Point bidId at node, replacing any existing entry
+ *
+ * @param bidId The node's key
+ * @param node The node to index
+ */
+void BidIndex::Assign(const string& bidId, Node* node) {
+    size_t slot = findSlot(bidId, std::hash<string>()(bidId));
+    if (slot == capacity)
+        Insert(bidId, node);
+    else
+        slots[slot] = node;
+}
+
+/**
+ * Drop bidId from the index
+ *
+ * @param bidId The key to remove
+ * return true if the key was indexed
+ */
+bool BidIndex::Erase(const string& bidId) {
+    size_t slot = findSlot(bidId, std::hash<string>()(bidId));
+    if (slot == capacity)
+        return false;
+    ctrl[slot] = DELETED;
+    slots[slot] = nullptr;
+    count--;
+    tombstones++;
+    return true;
+}
+
+size_t BidIndex::GetSize() const {
+    return count;
+}
+
+//============================================================================
+// Output sink class definitions
+//============================================================================
+
+// Output formats for bids
+enum BidFormat {
+    eDISPLAY = 0, // bidId: title | amount | fund
+    eCSV = 1,
+    ePIPE = 2,
+    eJSON = 3     // one JSON object per line
+};
+
+/**
+ * Visitor that receives the bids of a traversal one at a time
+ */
+class BidSink {
+
+public:
+    virtual ~BidSink() {}
+    virtual void Write(const Bid& bid) = 0;
+    virtual void Flush() = 0;
+};
+
+/**
+ * Sink that formats bids into a large reusable buffer
+ *
+ * Nothing is written to the stream until the buffer fills or Flush is
+ * called, so a full traversal costs a handful of writes instead of one
+ * flush per bid, and formatting never allocates.
+ */
+class BufferedBidWriter : public BidSink {
+
+private:
+    ostream& out;
+    BidFormat format;
+    char* buffer;
+    size_t used;
+    size_t capacity;
+
+    void append(const char* data, size_t length);
+    void append(const string& text);
+    void append(char c);
+    void appendAmount(double amount);
+    void appendQuotedField(const string& text, char separator);
+    void appendDisplayField(const string& text);
+    void appendJsonString(const string& text);
+
+public:
+    BufferedBidWriter(ostream& stream, BidFormat bidFormat, size_t bufferSize = 1 << 20);
+    virtual ~BufferedBidWriter();
+    void WriteHeader();
+    virtual void Write(const Bid& bid);
+    virtual void Flush();
+};
+
+/**
+ * Constructor
+ *
+ * @param stream Where the formatted bids go
+ * @param bidFormat How each bid is formatted
+ * @param bufferSize Bytes buffered between writes to the stream
+ */
+BufferedBidWriter::BufferedBidWriter(ostream& stream, BidFormat bidFormat, size_t bufferSize)
+    : out(stream) {
+    format = bidFormat;
+    capacity = bufferSize > 256 ? bufferSize : 256;
+    buffer = new char[capacity];
+    used = 0;
+}
+
+/**
+ * Write the column names, for formats that have them
+ */
+void BufferedBidWriter::WriteHeader() {
+    if (format == eCSV)
+        append(string("bidId,title,amount,fund\n"));
+    else if (format == ePIPE)
+        append(string("bidId|title|amount|fund\n"));
+}
+
+/**
+ * Destructor, flushes anything still buffered
+ */
+BufferedBidWriter::~BufferedBidWriter() {
+    Flush();
+    delete[] buffer;
+}
+
+/**
+ * Write the buffer to the stream
+ */
+void BufferedBidWriter::Flush() {
+    if (used != 0)
+        out.write(buffer, used);
+    out.flush();
+    used = 0;
+}
+
+/**
+ * Copy bytes into the buffer, writing it out first if they do not fit
+ */
+void BufferedBidWriter::append(const char* data, size_t length) {
+    if (used + length > capacity) {
+        out.write(buffer, used);
+        used = 0;
+        /// Longer than the whole buffer: skip the copy
+        if (length > capacity) {
+            out.write(data, length);
+            return;
+        }
+    }
+    memcpy(buffer + used, data, length);
+    used += length;
+}
+
+void BufferedBidWriter::append(const string& text) {
+    append(text.data(), text.size());
+}
+
+void BufferedBidWriter::append(char c) {
+    if (used == capacity) {
+        out.write(buffer, used);
+        used = 0;
+    }
+    buffer[used++] = c;
+}
+
+/**
+ * Format an amount like cout does for display, otherwise with the 17
+ * significant digits a double needs to read back exactly
+ *
+ * JSON has no NaN or infinity, so those become null there.
+ */
+void BufferedBidWriter::appendAmount(double amount) {
+    if (format == eJSON && !std::isfinite(amount)) {
+        append("null", 4);
+        return;
+    }
+    char digits[32];
+    int length = snprintf(digits, sizeof(digits), format == eDISPLAY ? "%g" : "%.17g", amount);
+    append(digits, length);
+}
+
+/**
+ * Quote a field when it holds the separator, a quote or a line break
+ * (RFC 4180, which csv::Parser reads back with the same separator)
+ */
+void BufferedBidWriter::appendQuotedField(const string& text, char separator) {
+    const char special[] = { separator, '"', '\r', '\n', '\0' };
+    if (text.find_first_of(special) == string::npos) {
+        append(text);
+        return;
+    }
+    append('"');
+    for (char c : text) {
+        if (c == '"')
+            append('"');
+        append(c);
+    }
+    append('"');
+}
+
+/**
+ * Append a field for display, with line breaks shown as spaces so every
+ * bid stays on one line
+ */
+void BufferedBidWriter::appendDisplayField(const string& text) {
+    if (text.find_first_of("\r\n") == string::npos) {
+        append(text);
+        return;
+    }
+    for (char c : text)
+        append(c == '\r' || c == '\n' ? ' ' : c);
+}
+
+/**
+ * Append a JSON string literal
+ */
+void BufferedBidWriter::appendJsonString(const string& text) {
+    append('"');
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            append('\\');
+            append(c);
+        }
+        else if ((unsigned char) c < 0x20) {
+            char escaped[8];
+            int length = snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char) c);
+            append(escaped, length);
+        }
+        else
+            append(c);
+    }
+    append('"');
+}
+
+/**
+ * Format one bid into the buffer
+ *
+ * @param bid The bid to write
+ */
+void BufferedBidWriter::Write(const Bid& bid) {
+    switch (format) {
+    case eCSV:
+        appendQuotedField(bid.bidId, ',');
+        append(',');
+        appendQuotedField(bid.title, ',');
+        append(',');
+        appendAmount(bid.amount);
+        append(',');
+        appendQuotedField(bid.fund, ',');
+        break;
+    case ePIPE:
+        appendQuotedField(bid.bidId, '|');
+        append('|');
+        appendQuotedField(bid.title, '|');
+        append('|');
+        appendAmount(bid.amount);
+        append('|');
+        appendQuotedField(bid.fund, '|');
+        break;
+    case eJSON:
+        append("{\"bidId\":", 9);
+        appendJsonString(bid.bidId);
+        append(",\"title\":", 9);
+        appendJsonString(bid.title);
+        append(",\"amount\":", 10);
+        appendAmount(bid.amount);
+        append(",\"fund\":", 8);
+        appendJsonString(bid.fund);
+        append('}');
+        break;
+    default:
+        appendDisplayField(bid.bidId);
+        append(": ", 2);
+        appendDisplayField(bid.title);
+        append(" | ", 3);
+        appendAmount(bid.amount);
+        append(" | ", 3);
+        appendDisplayField(bid.fund);
+        break;
+    }
+    append('\n');
+}
+
+// Sink that keeps every bid it is given
+class CollectingSink : public BidSink {
+
+public:
+    vector<Bid> bids;
+    virtual void Write(const Bid& bid) {
+        bids.push_back(bid);
     }
+    virtual void Flush() {
+    }
+};
+
+//============================================================================
+// Fork-join helpers
+//============================================================================
+
+/**
+ * Run work(task, worker) for every task index on a set of threads
+ *
+ * Workers claim the next unclaimed task from a shared counter, so a
+ * worker that finishes a small task early simply takes another one and
+ * uneven tasks still keep every thread busy. The calling thread is worker
+ * 0; it returns once all tasks are done.
+ *
+ * @param taskCount Number of tasks
+ * @param threadCount Number of workers, including the caller
+ * @param work The task body
+ */
+void runParallel(size_t taskCount, int threadCount, const function<void(size_t, int)>& work) {
+    atomic<size_t> nextTask(0);
+    auto worker = [&](int id) {
+        for (size_t task = nextTask++; task < taskCount; task = nextTask++)
+            work(task, id);
+    };
+
+    vector<thread> helpers;
+    for (int id = 1; id < threadCount && (size_t) id < taskCount; id++)
+        helpers.push_back(thread(worker, id));
+    worker(0);
+    for (auto& helper : helpers)
+        helper.join();
+}
+
+// Piece of a split traversal: a whole subtree, or just one node whose
+// subtrees are covered by neighbouring pieces
+struct TraversalTask {
+    Node* node;
+    bool wholeSubtree;
 };
 
 //============================================================================
@@ -63,25 +682,50 @@ class BinarySearchTree {
 private:
     Node* root;
     int size;
+    BidIndex* index;
+    Node* spareNodes;
+    vector<Node*> removePath;
 
     void addNode(Node* node, Bid bid);
-    void inOrder(Node* node);
-    void postOrder(Node* node);
-    void preOrder(Node* node);
-    Node* getParent(Node* parent, Node* node);
-    Node* removeNode(Node* parent, Node* node);
+    void inOrder(Node* node, BidSink& sink);
+    void postOrder(Node* node, BidSink& sink);
+    void preOrder(Node* node, BidSink& sink);
+    Node* allocNode(Bid bid);
+    void freeNode(Node* node);
+    void removeNode(Node* parent, Node* node);
+    void indexSubtree(Node* node);
+    void splitTasks(Node* node, int grain, vector<TraversalTask>& tasks);
+    void range(Node* node, const string& lowId, const string& highId, vector<Bid>& bids);
+    void collectAmounts(Node* node, const string* lowId, const string* highId,
+            vector<double>& amounts, map<string, AmountSummary>& byFund);
+    AmountReport summarize(const string* lowId, const string* highId, int bucketCount);
+    double totalBefore(const string& bidId, bool inclusive, int& count);
+    bool checkSubtree(Node* node, const string* lowId, const string* highId);
 
 public:
     BinarySearchTree();
     virtual ~BinarySearchTree();
     void DestroyRecursive(Node* node);
+    void DestroyParallel(int threadCount);
+    void EnableIndex();
     void InOrder();
     void PostOrder();
     void PreOrder();
+    void InOrder(BidSink& sink);
+    void PostOrder(BidSink& sink);
+    void PreOrder(BidSink& sink);
+    void ParallelInOrder(ostream& out, BidFormat format, int threadCount);
+    void ParallelVisit(vector<BidSink*>& sinks);
     void Insert(Bid bid);
-    void Remove(string bidId);
+    bool Remove(string bidId);
     Node* Search(string bidId);
-    void DisplayBid(Bid bid);
+    void Range(string lowId, string highId, vector<Bid>& bids);
+    AmountReport SummarizeAmounts(int bucketCount);
+    AmountReport SummarizeAmounts(string lowId, string highId, int bucketCount);
+    double RangeTotal(string lowId, string highId, int& count);
+    double GetTotal();
+    bool CheckInvariants();
+    void DisplayBid(const Bid& bid);
     int GetSize();
 };
 
@@ -90,6 +734,9 @@ public:
  */
 BinarySearchTree::BinarySearchTree() {
     root = nullptr;
+    size = 0;
+    index = nullptr;
+    spareNodes = nullptr;
 }
 
 /**
@@ -99,6 +746,12 @@ BinarySearchTree::BinarySearchTree() {
  */
 BinarySearchTree::~BinarySearchTree() {
     DestroyRecursive(root);
+    delete index;
+    while (spareNodes != nullptr) {
+        Node* next = spareNodes->right;
+        delete spareNodes;
+        spareNodes = next;
+    }
 }
 
 /**
@@ -113,305 +766,3151 @@ void BinarySearchTree::DestroyRecursive(Node* node) {
         delete node;
     }
 }
+
 /**
- * Traverse the tree in order
+ * Delete every node of the tree on several threads
+ *
+ * Not used by the destructor: with glibc, nodes freed by a thread other
+ * than the one that allocated them go back to the allocating thread's
+ * arena under its lock, so the threads can end up taking turns. Measure
+ * with the teardown benchmark before relying on it.
+ *
+ *@param threadCount Number of threads to use
+ */
+void BinarySearchTree::DestroyParallel(int threadCount) {
+    vector<TraversalTask> tasks;
+    splitTasks(root, size / (threadCount * 8) + 1, tasks);
+    runParallel(tasks.size(), threadCount, [&](size_t task, int) {
+        if (tasks[task].wholeSubtree)
+            DestroyRecursive(tasks[task].node);
+        else
+            delete tasks[task].node;
+    });
+    root = nullptr;
+    size = 0;
+}
+
+/**
+ * Answer exact bidId lookups from a hash index instead of the tree
+ *
+ * The index is kept in sync by Insert and Remove; the tree still serves
+ * the ordered traversals.
+ */
+void BinarySearchTree::EnableIndex() {
+    if (index != nullptr)
+        return;
+    index = new BidIndex();
+    indexSubtree(root);
+}
+
+/**
+ * Traverse the tree in order, displaying each bid
  */
 void BinarySearchTree::InOrder() {
-    inOrder(root);
+    if (root == nullptr) {
+        cout << "Tree is empty" << endl;
+        return;
+    }
+    BufferedBidWriter writer(cout, eDISPLAY);
+    inOrder(root, writer);
 }
 
 /**
- * Traverse the tree in post-order
+ * Traverse the tree in post-order, displaying each bid
  */
 void BinarySearchTree::PostOrder() {
-    postOrder(root);
+    if (root == nullptr) {
+        cout << "Tree is empty" << endl;
+        return;
+    }
+    BufferedBidWriter writer(cout, eDISPLAY);
+    postOrder(root, writer);
 }
 
 /**
- * Traverse the tree in pre-order
+ * Traverse the tree in pre-order, displaying each bid
  */
 void BinarySearchTree::PreOrder() {
-    preOrder(root);
+    if (root == nullptr) {
+        cout << "Tree is empty" << endl;
+        return;
+    }
+    BufferedBidWriter writer(cout, eDISPLAY);
+    preOrder(root, writer);
 }
 
 /**
- * Insert a bid
+ * Traverse the tree in order
  *
- *@param bid The bid to be inserted as a node in the tree
+ *@param sink Receives each bid; flushed at the end
  */
-void BinarySearchTree::Insert(Bid bid) {
-    /// root pointer does not point to a node
-    if (root == nullptr) {
-        root = new Node(bid);
-        size++;
-    }
-    /// add the bid to the appropriate location in the tree
-    else
-        addNode(root, bid);
+void BinarySearchTree::InOrder(BidSink& sink) {
+    inOrder(root, sink);
+    sink.Flush();
 }
 
 /**
- * Remove a bid
+ * Traverse the tree in post-order
  *
- *@param bidId The bidId to be removed from the tree.
+ *@param sink Receives each bid; flushed at the end
  */
-void BinarySearchTree::Remove(string bidId) {
-    Node* node = Search(bidId);
-    if (node == nullptr) {
-        cout << bidId << " not found." << endl;
-        return;
-    }
-    cout << bidId << " removed." << endl;
-    Node* parent = getParent(root, node);
-    removeNode(parent, node);
+void BinarySearchTree::PostOrder(BidSink& sink) {
+    postOrder(root, sink);
+    sink.Flush();
 }
 
 /**
- * Search for a bid
+ * Traverse the tree in pre-order
  *
- *@param bidId The bidId that will be checked against the tree's nodes' bidIds
+ *@param sink Receives each bid; flushed at the end
  */
-Node* BinarySearchTree::Search(string bidId) {
-    /// Start searching from root node
-    Node* curNode = root;
-    
+void BinarySearchTree::PreOrder(BidSink& sink) {
+    preOrder(root, sink);
+    sink.Flush();
+}
+
+/**
+ * Traverse the tree in order on several threads, keeping the output in order
+ *
+ * Each piece of the tree is formatted into its own buffer in parallel;
+ * the calling thread writes the buffers out in order as they complete.
+ *
+ *@param out Where the formatted bids go
+ *@param format How each bid is formatted
+ *@param threadCount Number of threads to use
+ */
+void BinarySearchTree::ParallelInOrder(ostream& out, BidFormat format, int threadCount) {
+    if (threadCount < 2) {
+        BufferedBidWriter writer(out, format);
+        InOrder(writer);
+        return;
+    }
+
+    vector<TraversalTask> tasks;
+    splitTasks(root, size / (threadCount * 8) + 1, tasks);
+    vector<string> pieces(tasks.size());
+    unique_ptr<atomic<bool>[]> finished(new atomic<bool>[tasks.size()]);
+    for (size_t i = 0; i < tasks.size(); i++)
+        finished[i].store(false);
+
+    /// Formatting runs on helper threads while this one writes
+    thread formatter([&]() {
+        runParallel(tasks.size(), threadCount - 1, [&](size_t task, int) {
+            ostringstream piece;
+            {
+                BufferedBidWriter writer(piece, format, 1 << 16);
+                if (tasks[task].wholeSubtree)
+                    inOrder(tasks[task].node, writer);
+                else
+                    writer.Write(tasks[task].node->bid);
+            }
+            pieces[task] = piece.str();
+            finished[task].store(true, memory_order_release);
+        });
+    });
+
+    for (size_t i = 0; i < tasks.size(); i++) {
+        while (!finished[i].load(memory_order_acquire))
+            this_thread::yield();
+        out.write(pieces[i].data(), pieces[i].size());
+        string().swap(pieces[i]);
+    }
+    formatter.join();
+    out.flush();
+}
+
+/**
+ * Visit every bid on several threads, one thread per sink
+ *
+ * Each sink only ever sees bids from its own thread, so sinks can keep
+ * unsynchronized per-thread state (partial totals, buffers) and be merged
+ * afterwards. The order in which a sink sees bids is unspecified.
+ *
+ *@param sinks One sink per thread
+ */
+void BinarySearchTree::ParallelVisit(vector<BidSink*>& sinks) {
+    if (sinks.empty())
+        return;
+    vector<TraversalTask> tasks;
+    splitTasks(root, size / (sinks.size() * 8) + 1, tasks);
+    runParallel(tasks.size(), sinks.size(), [&](size_t task, int worker) {
+        if (tasks[task].wholeSubtree)
+            inOrder(tasks[task].node, *sinks[worker]);
+        else
+            sinks[worker]->Write(tasks[task].node->bid);
+    });
+    for (BidSink* sink : sinks)
+        sink->Flush();
+}
+
+/**
+ * Insert a bid
+ *
+ *@param bid The bid to be inserted as a node in the tree
+ */
+void BinarySearchTree::Insert(Bid bid) {
+    /// root pointer does not point to a node
+    if (root == nullptr) {
+        root = allocNode(bid);
+        size++;
+        if (index != nullptr)
+            index->Insert(bid.bidId, root);
+    }
+    /// add the bid to the appropriate location in the tree
+    else
+        addNode(root, bid);
+}
+
+/**
+ * Remove a bid
+ *
+ *@param bidId The bidId to be removed from the tree.
+ * return true if a bid was removed
+ */
+bool BinarySearchTree::Remove(string bidId) {
+    /// Single descent from the root, remembering the path on the way down
+    removePath.clear();
+    Node* node = root;
+    while (node != nullptr && node->bid.bidId != bidId) {
+        removePath.push_back(node);
+        if (node->bid.bidId > bidId)
+            node = node->left;
+        else
+            node = node->right;
+    }
+    if (node == nullptr)
+        return false;
+
+    /// Every ancestor loses this bid from its cached subtree total
+    for (Node* ancestor : removePath) {
+        ancestor->subtreeTotal -= node->bid.amount;
+        ancestor->subtreeCount--;
+    }
+    removeNode(removePath.empty() ? nullptr : removePath.back(), node);
+    return true;
+}
+
+/**
+ * Search for a bid
+ *
+ *@param bidId The bidId that will be checked against the tree's nodes' bidIds
+ */
+Node* BinarySearchTree::Search(string bidId) {
+    /// Exact lookups go straight to the hash index when it is enabled
+    if (index != nullptr)
+        return index->Find(bidId);
+
+    /// Start searching from root node
+    Node* curNode = root;
+    
     while (curNode != nullptr) {
         /// If current node's bidId matches
         if (curNode->bid.bidId == bidId) {
             return curNode;
         }
-        /// bidId is lesser than current node's bidId
-        if (curNode->bid.bidId > bidId) {
-            curNode = curNode->left;
+        /// bidId is lesser than current node's bidId
+        if (curNode->bid.bidId > bidId) {
+            curNode = curNode->left;
+        }
+        /// bidId is greater than current node's bidId
+        else
+            curNode = curNode->right;
+    }
+    
+    return nullptr;
+}
+
+/**
+ * Display the bid information to the console (std::out)
+ *
+ * @param bid struct containing the bid info
+ */
+void BinarySearchTree::DisplayBid(const Bid& bid) {
+    cout << bid.bidId << ": " << bid.title << " | " << bid.amount << " | "
+            << bid.fund << endl;
+    return;
+}
+
+/**
+ * Collect the bids whose bidId lies in [lowId, highId], in order
+ *
+ *@param lowId Smallest bidId to include
+ *@param highId Largest bidId to include
+ *@param bids Matching bids are appended here
+ */
+void BinarySearchTree::Range(string lowId, string highId, vector<Bid>& bids) {
+    range(root, lowId, highId, bids);
+}
+
+/**
+ * Count, total, average, extremes and histogram of all bid amounts,
+ * overall and per fund
+ *
+ *@param bucketCount Number of histogram buckets
+ */
+AmountReport BinarySearchTree::SummarizeAmounts(int bucketCount) {
+    return summarize(nullptr, nullptr, bucketCount);
+}
+
+/**
+ * Count, total, average, extremes and histogram of the amounts of the
+ * bids whose bidId lies in [lowId, highId], overall and per fund
+ *
+ *@param lowId Smallest bidId to include
+ *@param highId Largest bidId to include
+ *@param bucketCount Number of histogram buckets
+ */
+AmountReport BinarySearchTree::SummarizeAmounts(string lowId, string highId, int bucketCount) {
+    return summarize(&lowId, &highId, bucketCount);
+}
+
+/**
+ * Build an amount report for a bidId range
+ *
+ * The amounts are gathered into a contiguous array first, so the overall
+ * summary and the histogram run on the vectorized kernels.
+ *
+ *@param lowId Smallest bidId to include, or nullptr for no lower bound
+ *@param highId Largest bidId to include, or nullptr for no upper bound
+ *@param bucketCount Number of histogram buckets
+ */
+AmountReport BinarySearchTree::summarize(const string* lowId, const string* highId, int bucketCount) {
+    AmountReport report;
+    vector<double> amounts;
+    if (lowId == nullptr && highId == nullptr)
+        amounts.reserve(size);
+    collectAmounts(root, lowId, highId, amounts, report.byFund);
+
+    report.overall = summarizeAmounts(amounts.data(), amounts.size());
+    if (report.overall.count != 0)
+        report.histogram = histogramAmounts(amounts.data(), amounts.size(),
+                report.overall.min, report.overall.max, bucketCount);
+    return report;
+}
+
+/**
+ * Sum of the amounts of the bids whose bidId lies in [lowId, highId]
+ *
+ * Uses the cached subtree totals, so it costs two root-to-leaf descents
+ * however many bids are in the range.
+ *
+ *@param lowId Smallest bidId to include
+ *@param highId Largest bidId to include
+ *@param count Receives the number of bids in the range
+ */
+double BinarySearchTree::RangeTotal(string lowId, string highId, int& count) {
+    count = 0;
+    if (highId < lowId)
+        return 0.0;
+    int lowCount;
+    double total = totalBefore(highId, true, count) - totalBefore(lowId, false, lowCount);
+    count -= lowCount;
+    return total;
+}
+
+/**
+ * Sum of the amounts of all bids, O(1)
+ */
+double BinarySearchTree::GetTotal() {
+    return root == nullptr ? 0.0 : root->subtreeTotal;
+}
+
+int BinarySearchTree::GetSize() {
+    return size;
+}
+
+/**
+ * Add a bid to some node (recursive)
+ *
+ * @param curNode Current node in tree
+ * @param bid Bid to be added
+ */
+void BinarySearchTree::addNode(Node* curNode, Bid bid) {
+    /// Find the bid's spot in the Tree by recursive searching the nodes for its appropriate location
+    /// The new bid will be below this node either way
+    curNode->subtreeTotal += bid.amount;
+    curNode->subtreeCount++;
+    /// Add node to left subtree
+    if (curNode->bid.bidId > bid.bidId) {
+        if (curNode->left == nullptr) {
+            curNode->left = allocNode(bid);
+            size++;
+            if (index != nullptr)
+                index->Insert(bid.bidId, curNode->left);
+        }
+        else
+            this->addNode(curNode->left, bid);
+    }
+    /// Add node to right subtree
+    else {
+        if (curNode->right == nullptr) {
+            curNode->right = allocNode(bid);
+            size++;
+            if (index != nullptr)
+                index->Insert(bid.bidId, curNode->right);
+        }
+        else
+            this->addNode(curNode->right, bid);
+    }
+}
+/**
+ * Inorder tree traversal (recursive)
+ *
+ *@param node Current node in tree
+ */
+void BinarySearchTree::inOrder(Node* node, BidSink& sink) {
+    if (node == nullptr)
+        return;
+    if (node->left != nullptr)
+        inOrder(node->left, sink);
+        
+    sink.Write(node->bid);
+    
+    if (node->right != nullptr)
+        inOrder(node->right, sink);
+}
+/**
+ * Post-order tree traversal (recursive)
+ *
+ *@param node Current node in tree
+ */
+void BinarySearchTree::postOrder(Node* node, BidSink& sink) {
+    if (node == nullptr)
+        return;
+    if (node->left != nullptr)
+        postOrder(node->left, sink);
+    if (node->right != nullptr)
+        postOrder(node->right, sink);
+    
+    sink.Write(node->bid);
+}
+/**
+ * Pre-order tree traversal (recursive)
+ *
+ *@param node Current node in tree
+ */
+void BinarySearchTree::preOrder(Node* node, BidSink& sink) {
+    if (node == nullptr)
+        return;
+    
+    sink.Write(node->bid);
+    
+    if (node->left != nullptr)
+        preOrder(node->left, sink);
+    if (node->right != nullptr)
+        preOrder(node->right, sink);
+}
+
+/**
+ * Unlink a node from the tree and recycle it
+ *
+ * A node with two children is replaced by relinking its in-order
+ * successor into its place, so no bid is ever copied between nodes.
+ *
+ *@param parent The parent of the node to be deleted, nullptr for the root
+ *@param node The node to be deleted
+ *
+ * Credit: ZYBooks CS300: Data Structures and Algorithms
+*/
+void BinarySearchTree::removeNode(Node* parent, Node* node) {
+    Node* replacement;
+    /// Node to be deleted has at most one child
+    if (node->left == nullptr)
+        replacement = node->right;
+    else if (node->right == nullptr)
+        replacement = node->left;
+    /// Node to be deleted has two children
+    else {
+        Node* succParent = node;
+        Node* succNode = node->right;
+        while (succNode->left != nullptr) {
+            succParent = succNode;
+            succNode = succNode->left;
+        }
+        /// Nodes between the removed node and its successor lose the successor
+        for (Node* curNode = node->right; curNode != succNode; curNode = curNode->left) {
+            curNode->subtreeTotal -= succNode->bid.amount;
+            curNode->subtreeCount--;
+        }
+        succNode->subtreeTotal = node->subtreeTotal - node->bid.amount;
+        succNode->subtreeCount = node->subtreeCount - 1;
+
+        /// Detach the successor, then give it the removed node's children
+        if (succParent != node) {
+            succParent->left = succNode->right;
+            succNode->right = node->right;
+        }
+        succNode->left = node->left;
+        replacement = succNode;
+    }
+
+    if (parent == nullptr)
+        root = replacement;
+    else if (parent->left == node)
+        parent->left = replacement;
+    else
+        parent->right = replacement;
+
+    /// Duplicates go right, so the next node with this bidId is under the replacement
+    if (index != nullptr) {
+        const string& bidId = node->bid.bidId;
+        index->Erase(bidId);
+        Node* duplicate = replacement;
+        while (duplicate != nullptr && duplicate->bid.bidId != bidId)
+            duplicate = duplicate->bid.bidId > bidId ? duplicate->left : duplicate->right;
+        if (duplicate != nullptr)
+            index->Assign(bidId, duplicate);
+    }
+
+    size--;
+    freeNode(node);
+}
+
+/**
+ * Take a node from the spare list, or allocate one if it is empty
+ *
+ *@param bid The bid to store in the node
+ */
+Node* BinarySearchTree::allocNode(Bid bid) {
+    if (spareNodes == nullptr)
+        return new Node(bid);
+
+    Node* node = spareNodes;
+    spareNodes = node->right;
+    node->bid = bid;
+    node->left = nullptr;
+    node->right = nullptr;
+    node->subtreeTotal = bid.amount;
+    node->subtreeCount = 1;
+    return node;
+}
+
+/**
+ * Return a removed node to the spare list for the next insert
+ *
+ * Keeping removed nodes around caps memory at the high-water mark of the
+ * tree under insert/remove churn instead of returning to the allocator.
+ *
+ *@param node The unlinked node
+ */
+void BinarySearchTree::freeNode(Node* node) {
+    node->left = nullptr;
+    node->right = spareNodes;
+    spareNodes = node;
+}
+
+/**
+ * Inorder traversal limited to a bidId range (recursive)
+ *
+ * Left subtrees hold smaller bidIds and right subtrees equal or larger
+ * ones, so whole subtrees outside the range are skipped.
+ *
+ *@param node Current node in tree
+ *@param lowId Smallest bidId to include
+ *@param highId Largest bidId to include
+ *@param bids Matching bids are appended here
+ */
+void BinarySearchTree::range(Node* node, const string& lowId, const string& highId, vector<Bid>& bids) {
+    if (node == nullptr)
+        return;
+    if (node->bid.bidId > lowId)
+        range(node->left, lowId, highId, bids);
+    if (node->bid.bidId >= lowId && node->bid.bidId <= highId)
+        bids.push_back(node->bid);
+    if (node->bid.bidId <= highId)
+        range(node->right, lowId, highId, bids);
+}
+
+/**
+ * Amounts of the bids in a bidId range, also summarized per fund (recursive)
+ *
+ *@param node Current node in tree
+ *@param lowId Smallest bidId to include, or nullptr for no lower bound
+ *@param highId Largest bidId to include, or nullptr for no upper bound
+ *@param amounts Matching amounts are appended here, in bidId order
+ *@param byFund Matching amounts are added to their fund's summary
+ */
+void BinarySearchTree::collectAmounts(Node* node, const string* lowId, const string* highId,
+        vector<double>& amounts, map<string, AmountSummary>& byFund) {
+    if (node == nullptr)
+        return;
+    bool aboveLow = lowId == nullptr || node->bid.bidId >= *lowId;
+    bool belowHigh = highId == nullptr || node->bid.bidId <= *highId;
+    if (lowId == nullptr || node->bid.bidId > *lowId)
+        collectAmounts(node->left, lowId, highId, amounts, byFund);
+    if (aboveLow && belowHigh) {
+        amounts.push_back(node->bid.amount);
+        byFund[node->bid.fund].Add(node->bid.amount);
+    }
+    if (belowHigh)
+        collectAmounts(node->right, lowId, highId, amounts, byFund);
+}
+
+/**
+ * Total of the bids ordered before a bidId, from cached subtree totals
+ *
+ * Whenever the descent goes right, the node and its whole left subtree
+ * are before bidId and are added in one step.
+ *
+ *@param bidId The bound
+ *@param inclusive Whether bids equal to bidId are counted
+ *@param count Receives the number of bids counted
+ */
+double BinarySearchTree::totalBefore(const string& bidId, bool inclusive, int& count) {
+    double total = 0.0;
+    count = 0;
+    Node* curNode = root;
+    while (curNode != nullptr) {
+        bool before = inclusive ? curNode->bid.bidId <= bidId : curNode->bid.bidId < bidId;
+        if (before) {
+            if (curNode->left != nullptr) {
+                total += curNode->left->subtreeTotal;
+                count += curNode->left->subtreeCount;
+            }
+            total += curNode->bid.amount;
+            count++;
+            curNode = curNode->right;
+        }
+        else
+            curNode = curNode->left;
+    }
+    return total;
+}
+
+/**
+ * Check ordering, cached subtree totals and the hash index
+ *
+ * Walks the whole tree; meant for self-checks, not for normal use.
+ *
+ * return true if the tree is consistent
+ */
+bool BinarySearchTree::CheckInvariants() {
+    if (!checkSubtree(root, nullptr, nullptr))
+        return false;
+    if (size != (root == nullptr ? 0 : root->subtreeCount))
+        return false;
+    if (index != nullptr && index->GetSize() > (size_t) size)
+        return false;
+    return true;
+}
+
+/**
+ * Check one subtree against its bidId bounds (recursive)
+ *
+ * Left subtrees hold bidIds below their parent's, right subtrees bidIds
+ * equal or above.
+ *
+ *@param node Current node in tree
+ *@param lowId Smallest bidId allowed, nullptr for none
+ *@param highId BidIds must be below this, nullptr for none
+ */
+bool BinarySearchTree::checkSubtree(Node* node, const string* lowId, const string* highId) {
+    if (node == nullptr)
+        return true;
+    if ((lowId != nullptr && node->bid.bidId < *lowId) || (highId != nullptr && node->bid.bidId >= *highId))
+        return false;
+
+    int count = 1;
+    double total = node->bid.amount;
+    if (node->left != nullptr) {
+        count += node->left->subtreeCount;
+        total += node->left->subtreeTotal;
+    }
+    if (node->right != nullptr) {
+        count += node->right->subtreeCount;
+        total += node->right->subtreeTotal;
+    }
+    if (count != node->subtreeCount || fabs(total - node->subtreeTotal) > 1e-6 * max(1.0, fabs(total)))
+        return false;
+
+    /// Whatever the index holds for this bidId must carry the same bidId
+    if (index != nullptr) {
+        Node* indexed = index->Find(node->bid.bidId);
+        if (indexed == nullptr || indexed->bid.bidId != node->bid.bidId)
+            return false;
+    }
+
+    return checkSubtree(node->left, lowId, &node->bid.bidId)
+            && checkSubtree(node->right, &node->bid.bidId, highId);
+}
+
+/**
+ * Cut a subtree into in-order pieces of at most grain bids (recursive)
+ *
+ * Uses the cached subtree counts, so pieces are balanced by size rather
+ * than by depth.
+ *
+ *@param node Current node in tree
+ *@param grain Largest subtree handed out whole
+ *@param tasks Pieces are appended here in order
+ */
+void BinarySearchTree::splitTasks(Node* node, int grain, vector<TraversalTask>& tasks) {
+    if (node == nullptr)
+        return;
+    if (node->subtreeCount <= grain) {
+        tasks.push_back({node, true});
+        return;
+    }
+    splitTasks(node->left, grain, tasks);
+    tasks.push_back({node, false});
+    splitTasks(node->right, grain, tasks);
+}
+
+/**
+ * Add a subtree to the hash index (recursive)
+ *
+ * Pre-order so that the topmost of several equal bidIds is the one indexed,
+ * matching what a tree search would return.
+ *
+ *@param node Current node in tree
+ */
+void BinarySearchTree::indexSubtree(Node* node) {
+    if (node == nullptr)
+        return;
+    index->Insert(node->bid.bidId, node);
+    indexSubtree(node->left);
+    indexSubtree(node->right);
+}
+
+//============================================================================
+// Persistent Binary Search Tree class definition
+//============================================================================
+
+// Immutable tree node shared between versions
+struct PersistentNode;
+typedef shared_ptr<const PersistentNode> Version;
+
+struct PersistentNode {
+    Bid bid;
+    Version left;
+    Version right;
+
+    PersistentNode(const Bid& aBid, Version aLeft, Version aRight)
+        : bid(aBid), left(aLeft), right(aRight) {
+    }
+};
+
+/**
+ * Binary search tree whose nodes are never modified once published
+ *
+ * Insert and Remove copy only the nodes on the path to the change and
+ * return the new root; every other node is shared with the previous
+ * version. A Version keeps its whole tree alive through reference counts,
+ * so a snapshot is one pointer copy and stays readable while writers carry
+ * on. Writers are serialized among themselves only.
+ */
+class PersistentBinarySearchTree {
+
+private:
+    Version root;
+    mutex writeLock;
+
+    static Version addNode(const Version& node, const Bid& bid);
+    static Version removeNode(const Version& node, const string& bidId, bool& removed);
+    static Version removeMin(const Version& node, Version& minNode);
+    static void inOrder(const Version& node, BidSink& sink);
+
+public:
+    Version Snapshot() const;
+    Version Insert(Bid bid);
+    Version Remove(string bidId);
+    static const PersistentNode* Search(const Version& version, string bidId);
+    static void InOrder(const Version& version);
+    static void InOrder(const Version& version, BidSink& sink);
+};
+
+/**
+ * Current version of the tree, O(1)
+ */
+Version PersistentBinarySearchTree::Snapshot() const {
+    return atomic_load(&root);
+}
+
+/**
+ * Insert a bid into a new version of the tree
+ *
+ *@param bid The bid to be inserted
+ * return the new version
+ */
+Version PersistentBinarySearchTree::Insert(Bid bid) {
+    lock_guard<mutex> guard(writeLock);
+    Version next = addNode(atomic_load(&root), bid);
+    atomic_store(&root, next);
+    return next;
+}
+
+/**
+ * Remove a bid in a new version of the tree
+ *
+ *@param bidId The bidId to be removed
+ * return the new version, the current one if bidId is not present
+ */
+Version PersistentBinarySearchTree::Remove(string bidId) {
+    lock_guard<mutex> guard(writeLock);
+    bool removed = false;
+    Version current = atomic_load(&root);
+    Version next = removeNode(current, bidId, removed);
+    if (!removed)
+        return current;
+    atomic_store(&root, next);
+    return next;
+}
+
+/**
+ * Search one version of the tree for a bid
+ *
+ *@param version The version to search
+ *@param bidId The bidId to look for
+ */
+const PersistentNode* PersistentBinarySearchTree::Search(const Version& version, string bidId) {
+    const PersistentNode* curNode = version.get();
+    while (curNode != nullptr) {
+        if (curNode->bid.bidId == bidId)
+            return curNode;
+        if (curNode->bid.bidId > bidId)
+            curNode = curNode->left.get();
+        else
+            curNode = curNode->right.get();
+    }
+    return nullptr;
+}
+
+/**
+ * Traverse one version of the tree in order
+ *
+ *@param version The version to display
+ */
+void PersistentBinarySearchTree::InOrder(const Version& version) {
+    if (version == nullptr) {
+        cout << "Tree is empty" << endl;
+        return;
+    }
+    BufferedBidWriter writer(cout, eDISPLAY);
+    inOrder(version, writer);
+}
+
+/**
+ * Traverse one version of the tree in order
+ *
+ *@param version The version to traverse
+ *@param sink Receives each bid; flushed at the end
+ */
+void PersistentBinarySearchTree::InOrder(const Version& version, BidSink& sink) {
+    if (version != nullptr)
+        inOrder(version, sink);
+    sink.Flush();
+}
+
+/**
+ * Copy the path to a bid's position and attach it there (recursive)
+ *
+ *@param node Current node in the old version
+ *@param bid Bid to be added
+ */
+Version PersistentBinarySearchTree::addNode(const Version& node, const Bid& bid) {
+    if (node == nullptr)
+        return make_shared<const PersistentNode>(bid, nullptr, nullptr);
+    if (node->bid.bidId > bid.bidId)
+        return make_shared<const PersistentNode>(node->bid, addNode(node->left, bid), node->right);
+    return make_shared<const PersistentNode>(node->bid, node->left, addNode(node->right, bid));
+}
+
+/**
+ * Copy the path to a bid and leave it out of the new version (recursive)
+ *
+ *@param node Current node in the old version
+ *@param bidId The bidId to be removed
+ *@param removed Set to true if a node was removed
+ */
+Version PersistentBinarySearchTree::removeNode(const Version& node, const string& bidId, bool& removed) {
+    if (node == nullptr)
+        return node;
+    if (node->bid.bidId != bidId) {
+        Version child;
+        if (node->bid.bidId > bidId) {
+            child = removeNode(node->left, bidId, removed);
+            return removed ? make_shared<const PersistentNode>(node->bid, child, node->right) : node;
+        }
+        child = removeNode(node->right, bidId, removed);
+        return removed ? make_shared<const PersistentNode>(node->bid, node->left, child) : node;
+    }
+
+    removed = true;
+    if (node->left == nullptr)
+        return node->right;
+    if (node->right == nullptr)
+        return node->left;
+
+    /// Two children: a copy of the in-order successor takes the node's place
+    Version succNode;
+    Version right = removeMin(node->right, succNode);
+    return make_shared<const PersistentNode>(succNode->bid, node->left, right);
+}
+
+/**
+ * Copy the path to the smallest bid of a subtree and leave it out (recursive)
+ *
+ *@param node Current node in the old version
+ *@param minNode Set to the node that was left out
+ */
+Version PersistentBinarySearchTree::removeMin(const Version& node, Version& minNode) {
+    if (node->left == nullptr) {
+        minNode = node;
+        return node->right;
+    }
+    return make_shared<const PersistentNode>(node->bid, removeMin(node->left, minNode), node->right);
+}
+
+/**
+ * Inorder traversal of one version (recursive)
+ *
+ *@param node Current node in tree
+ */
+void PersistentBinarySearchTree::inOrder(const Version& node, BidSink& sink) {
+    if (node->left != nullptr)
+        inOrder(node->left, sink);
+
+    sink.Write(node->bid);
+
+    if (node->right != nullptr)
+        inOrder(node->right, sink);
+}
+
+//============================================================================
+// Sharded Binary Search Tree class definition
+//============================================================================
+
+/**
+ * Container that partitions bids across independent trees by bidId range
+ *
+ * Shard i holds the bidIds in [splits[i - 1], splits[i]). Each shard has
+ * its own lock, so writers to different shards never wait on each other,
+ * and a batch insert gives every shard its own thread. Because the shards
+ * are ordered by range, an ordered traversal visits them one after another
+ * and a range query only locks the shards it overlaps.
+ *
+ * The split points are chosen once, from the first batch insert, and
+ * published through an atomic flag; after that routing takes no container
+ * lock. Until then every operation is serialized on routingLock and all
+ * bids live in shard 0, and the first batch moves them to their shards.
+ * The splits are never revisited, so later batches with a very different
+ * bidId distribution can leave the shards unbalanced.
+ *
+ * InsertBatch starts one thread per shard on every call, which pays off
+ * for bulk loads but not for small batches; use Insert for those.
+ */
+class ShardedBinarySearchTree {
+
+private:
+    struct Shard {
+        BinarySearchTree tree;
+        mutex lock;
+    };
+
+    Shard* shards;
+    int shardCount;
+    vector<string> splits;
+    atomic<bool> splitsFixed;
+    mutex routingLock;
+
+    int shardFor(const string& bidId) const;
+    unique_lock<mutex> lockRouting();
+    void chooseSplits(const vector<Bid>& bids);
+
+public:
+    ShardedBinarySearchTree(int count);
+    virtual ~ShardedBinarySearchTree();
+    void Insert(Bid bid);
+    void InsertBatch(const vector<Bid>& bids);
+    bool Remove(string bidId);
+    bool Search(string bidId, Bid& bid);
+    void Range(string lowId, string highId, vector<Bid>& bids);
+    void InOrder();
+    void InOrder(BidSink& sink);
+    int GetSize();
+};
+
+/**
+ * Constructor
+ *
+ *@param count Number of shards, usually the number of cores
+ */
+ShardedBinarySearchTree::ShardedBinarySearchTree(int count) {
+    shardCount = count > 0 ? count : 1;
+    shards = new Shard[shardCount];
+    splitsFixed = shardCount == 1;
+}
+
+/**
+ * Destructor
+ */
+ShardedBinarySearchTree::~ShardedBinarySearchTree() {
+    delete[] shards;
+}
+
+/**
+ * Index of the shard that owns a bidId
+ *
+ *@param bidId The bidId to route
+ */
+int ShardedBinarySearchTree::shardFor(const string& bidId) const {
+    return upper_bound(splits.begin(), splits.end(), bidId) - splits.begin();
+}
+
+/**
+ * Hold the routing lock while the split points may still change
+ *
+ * return the held lock, or an empty one once the splits are fixed
+ */
+unique_lock<mutex> ShardedBinarySearchTree::lockRouting() {
+    if (splitsFixed.load(memory_order_acquire))
+        return unique_lock<mutex>();
+    unique_lock<mutex> routing(routingLock);
+    if (splitsFixed.load(memory_order_relaxed))
+        routing.unlock();
+    return routing;
+}
+
+/**
+ * Pick shard boundaries from the bidId quantiles of the first batch
+ *
+ * Bids inserted one at a time before then all sit in shard 0; they are
+ * counted in the quantiles and moved to their shards here, so early
+ * single inserts don't pin the whole tree to one shard.
+ *
+ *@param bids The batch to sample
+ */
+void ShardedBinarySearchTree::chooseSplits(const vector<Bid>& bids) {
+    if (splitsFixed.load(memory_order_acquire) || bids.empty())
+        return;
+    lock_guard<mutex> routing(routingLock);
+    if (splitsFixed.load(memory_order_relaxed))
+        return;
+
+    lock_guard<mutex> guard(shards[0].lock);
+    CollectingSink early;
+    shards[0].tree.InOrder(early);
+
+    vector<string> ids;
+    ids.reserve(bids.size() + early.bids.size());
+    for (auto const& bid : bids)
+        ids.push_back(bid.bidId);
+    for (auto const& bid : early.bids)
+        ids.push_back(bid.bidId);
+    sort(ids.begin(), ids.end());
+
+    for (int i = 1; i < shardCount; i++)
+        splits.push_back(ids[ids.size() * i / shardCount]);
+
+    for (auto const& bid : early.bids) {
+        int i = shardFor(bid.bidId);
+        if (i == 0)
+            continue;
+        shards[0].tree.Remove(bid.bidId);
+        lock_guard<mutex> target(shards[i].lock);
+        shards[i].tree.Insert(bid);
+    }
+    splitsFixed.store(true, memory_order_release);
+}
+
+/**
+ * Insert a bid into the shard that owns its bidId
+ *
+ *@param bid The bid to be inserted
+ */
+void ShardedBinarySearchTree::Insert(Bid bid) {
+    unique_lock<mutex> routing = lockRouting();
+    Shard& shard = shards[shardFor(bid.bidId)];
+    lock_guard<mutex> guard(shard.lock);
+    shard.tree.Insert(bid);
+}
+
+/**
+ * Insert a batch of bids, one thread per shard
+ *
+ *@param bids The bids to be inserted
+ */
+void ShardedBinarySearchTree::InsertBatch(const vector<Bid>& bids) {
+    chooseSplits(bids);
+    unique_lock<mutex> routing = lockRouting();
+
+    /// Route first so each thread only touches its own shard
+    vector<vector<const Bid*>> routed(shardCount);
+    for (auto const& bid : bids)
+        routed[shardFor(bid.bidId)].push_back(&bid);
+
+    vector<thread> workers;
+    for (int i = 0; i < shardCount; i++) {
+        if (routed[i].empty())
+            continue;
+        workers.push_back(thread([this, i, &routed]() {
+            lock_guard<mutex> guard(shards[i].lock);
+            for (const Bid* bid : routed[i])
+                shards[i].tree.Insert(*bid);
+        }));
+    }
+    for (auto& worker : workers)
+        worker.join();
+}
+
+/**
+ * Remove a bid from the shard that owns its bidId
+ *
+ *@param bidId The bidId to be removed
+ * return true if a bid was removed
+ */
+bool ShardedBinarySearchTree::Remove(string bidId) {
+    unique_lock<mutex> routing = lockRouting();
+    Shard& shard = shards[shardFor(bidId)];
+    lock_guard<mutex> guard(shard.lock);
+    return shard.tree.Remove(bidId);
+}
+
+/**
+ * Search for a bid
+ *
+ * The bid is copied out under the shard lock, since the node may be
+ * removed by another thread as soon as the lock is released.
+ *
+ *@param bidId The bidId to look for
+ *@param bid Receives the bid when found
+ * return true if the bid was found
+ */
+bool ShardedBinarySearchTree::Search(string bidId, Bid& bid) {
+    unique_lock<mutex> routing = lockRouting();
+    Shard& shard = shards[shardFor(bidId)];
+    lock_guard<mutex> guard(shard.lock);
+    Node* node = shard.tree.Search(bidId);
+    if (node == nullptr)
+        return false;
+    bid = node->bid;
+    return true;
+}
+
+/**
+ * Collect the bids whose bidId lies in [lowId, highId], in order
+ *
+ *@param lowId Smallest bidId to include
+ *@param highId Largest bidId to include
+ *@param bids Matching bids are appended here
+ */
+void ShardedBinarySearchTree::Range(string lowId, string highId, vector<Bid>& bids) {
+    if (highId < lowId)
+        return;
+    unique_lock<mutex> routing = lockRouting();
+    int last = shardFor(highId);
+    for (int i = shardFor(lowId); i <= last; i++) {
+        lock_guard<mutex> guard(shards[i].lock);
+        shards[i].tree.Range(lowId, highId, bids);
+    }
+}
+
+/**
+ * Traverse all shards in order
+ */
+void ShardedBinarySearchTree::InOrder() {
+    if (GetSize() == 0) {
+        cout << "Tree is empty" << endl;
+        return;
+    }
+    BufferedBidWriter writer(cout, eDISPLAY);
+    InOrder(writer);
+}
+
+/**
+ * Traverse all shards in order
+ *
+ *@param sink Receives each bid; flushed at the end
+ */
+void ShardedBinarySearchTree::InOrder(BidSink& sink) {
+    unique_lock<mutex> routing = lockRouting();
+    for (int i = 0; i < shardCount; i++) {
+        lock_guard<mutex> guard(shards[i].lock);
+        shards[i].tree.InOrder(sink);
+    }
+}
+
+int ShardedBinarySearchTree::GetSize() {
+    unique_lock<mutex> routing = lockRouting();
+    int total = 0;
+    for (int i = 0; i < shardCount; i++) {
+        lock_guard<mutex> guard(shards[i].lock);
+        total += shards[i].tree.GetSize();
+    }
+    return total;
+}
+
+//============================================================================
+// Columnar bid store class definition
+//============================================================================
+
+/**
+ * Column-oriented storage for bids
+ *
+ * Each row's bidId and title are packed into one string arena as
+ * length-prefixed entries, funds are replaced by an id into a small
+ * dictionary of distinct fund names, and amounts live in a dense array
+ * of doubles that can be scanned without touching the tree. Rows are
+ * addressed by their index. Released rows go on a free list and are
+ * reused by later appends; the arena is compacted once more than half of
+ * it belongs to released rows. LiveRows() marks which rows are in use, so
+ * scans over the columns can skip the free ones.
+ */
+class BidStore {
+
+private:
+    string arena;
+    vector<size_t> entryOffsets;
+    vector<uint32_t> fundIds;
+    vector<double> amounts;
+    vector<uint8_t> live;
+    vector<string> fundNames;
+    unordered_map<string, uint32_t> fundLookup;
+    vector<uint32_t> freeRows;
+    size_t deadBytes;
+
+    void appendLength(size_t length);
+    const char* entryField(size_t row, int field, size_t& length) const;
+    size_t entrySize(size_t row) const;
+    void compactArena();
+
+public:
+    BidStore();
+    size_t Append(const Bid& bid);
+    void Release(size_t row);
+    void ShrinkToFit();
+    Bid GetBid(size_t row) const;
+    int CompareKey(size_t row, const string& bidId) const;
+    void CopyKey(size_t row, string& bidId) const;
+    string GetTitle(size_t row) const;
+    void CopyTitle(size_t row, string& title) const;
+    uint32_t GetFundId(size_t row) const;
+    const string& GetFundName(uint32_t fundId) const;
+    size_t FundCount() const;
+    const double* Amounts() const;
+    const uint32_t* FundIds() const;
+    const uint8_t* LiveRows() const;
+    size_t RowCount() const;
+    size_t FreeRowCount() const;
+    size_t LiveRowCount() const;
+};
+
+/**
+ * Default constructor
+ */
+BidStore::BidStore() {
+    deadBytes = 0;
+}
+
+/**
+ * Append a length to the arena as a little-endian base-128 varint
+ */
+void BidStore::appendLength(size_t length) {
+    while (length >= 0x80) {
+        arena.push_back((char) (length | 0x80));
+        length >>= 7;
+    }
+    arena.push_back((char) length);
+}
+
+/**
+ * Locate one field of a row's arena entry
+ *
+ *@param row The row index
+ *@param field 0 for the bidId, 1 for the title
+ *@param length Receives the field's length
+ * return the first byte of the field
+ */
+const char* BidStore::entryField(size_t row, int field, size_t& length) const {
+    const char* next = arena.data() + entryOffsets[row];
+    for (int i = 0; ; i++) {
+        length = 0;
+        int shift = 0;
+        unsigned char byte;
+        do {
+            byte = *next++;
+            length |= (size_t) (byte & 0x7f) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        if (i == field)
+            return next;
+        next += length;
+    }
+}
+
+/**
+ * Bytes taken by a row's arena entry, length prefixes included
+ */
+size_t BidStore::entrySize(size_t row) const {
+    size_t length;
+    const char* title = entryField(row, 1, length);
+    return title + length - (arena.data() + entryOffsets[row]);
+}
+
+/**
+ * Store a bid, reusing a released row when there is one
+ *
+ *@param bid The bid to store
+ * return the row index
+ */
+size_t BidStore::Append(const Bid& bid) {
+    auto found = fundLookup.find(bid.fund);
+    if (found == fundLookup.end()) {
+        found = fundLookup.insert(make_pair(bid.fund, (uint32_t) fundNames.size())).first;
+        fundNames.push_back(bid.fund);
+    }
+
+    size_t row;
+    if (!freeRows.empty()) {
+        row = freeRows.back();
+        freeRows.pop_back();
+        entryOffsets[row] = arena.size();
+        fundIds[row] = found->second;
+        amounts[row] = bid.amount;
+        live[row] = 1;
+    } else {
+        row = amounts.size();
+        entryOffsets.push_back(arena.size());
+        fundIds.push_back(found->second);
+        amounts.push_back(bid.amount);
+        live.push_back(1);
+    }
+
+    appendLength(bid.bidId.size());
+    arena.append(bid.bidId);
+    appendLength(bid.title.size());
+    arena.append(bid.title);
+    return row;
+}
+
+/**
+ * Give a row back for reuse
+ *
+ * The row is cleared in LiveRows() and its amount zeroed; column scans
+ * should skip rows that are not live.
+ *
+ *@param row The row index, which must not be used again until Append returns it
+ */
+void BidStore::Release(size_t row) {
+    deadBytes += entrySize(row);
+    live[row] = 0;
+    amounts[row] = 0.0;
+    freeRows.push_back(row);
+
+    if (deadBytes > 4096 && deadBytes * 2 > arena.size())
+        compactArena();
+}
+
+/**
+ * Rewrite the arena with only the live entries, in row order
+ */
+void BidStore::compactArena() {
+    string compacted;
+    compacted.reserve(arena.size() - deadBytes);
+    for (size_t row = 0; row < entryOffsets.size(); row++) {
+        if (!live[row])
+            continue;
+        size_t offset = compacted.size();
+        compacted.append(arena, entryOffsets[row], entrySize(row));
+        entryOffsets[row] = offset;
+    }
+    arena.swap(compacted);
+    deadBytes = 0;
+}
+
+/**
+ * Release the spare capacity of the columns, e.g. after a bulk load
+ */
+void BidStore::ShrinkToFit() {
+    arena.shrink_to_fit();
+    entryOffsets.shrink_to_fit();
+    fundIds.shrink_to_fit();
+    amounts.shrink_to_fit();
+    live.shrink_to_fit();
+}
+
+/**
+ * Rebuild a full bid from its row
+ *
+ *@param row The row index
+ */
+Bid BidStore::GetBid(size_t row) const {
+    Bid bid;
+    CopyKey(row, bid.bidId);
+    CopyTitle(row, bid.title);
+    bid.fund = fundNames[fundIds[row]];
+    bid.amount = amounts[row];
+    return bid;
+}
+
+/**
+ * Compare a row's bidId with another, like string::compare
+ *
+ *@param row The row index
+ *@param bidId The bidId to compare against
+ * return negative, zero or positive as the row's bidId sorts before, equal to or after bidId
+ */
+int BidStore::CompareKey(size_t row, const string& bidId) const {
+    size_t length;
+    const char* key = entryField(row, 0, length);
+    return -bidId.compare(0, string::npos, key, length);
+}
+
+/**
+ * Copy a row's bidId into an existing string, reusing its storage
+ */
+void BidStore::CopyKey(size_t row, string& bidId) const {
+    size_t length;
+    const char* key = entryField(row, 0, length);
+    bidId.assign(key, length);
+}
+
+string BidStore::GetTitle(size_t row) const {
+    string title;
+    CopyTitle(row, title);
+    return title;
+}
+
+/**
+ * Copy a row's title into an existing string, reusing its storage
+ */
+void BidStore::CopyTitle(size_t row, string& title) const {
+    size_t length;
+    const char* text = entryField(row, 1, length);
+    title.assign(text, length);
+}
+
+uint32_t BidStore::GetFundId(size_t row) const {
+    return fundIds[row];
+}
+
+const string& BidStore::GetFundName(uint32_t fundId) const {
+    return fundNames[fundId];
+}
+
+size_t BidStore::FundCount() const {
+    return fundNames.size();
+}
+
+const double* BidStore::Amounts() const {
+    return amounts.data();
+}
+
+const uint32_t* BidStore::FundIds() const {
+    return fundIds.data();
+}
+
+/**
+ * One byte per row, 1 while the row holds a bid
+ */
+const uint8_t* BidStore::LiveRows() const {
+    return live.data();
+}
+
+/**
+ * Number of rows, including released ones waiting for reuse
+ */
+size_t BidStore::RowCount() const {
+    return amounts.size();
+}
+
+size_t BidStore::FreeRowCount() const {
+    return freeRows.size();
+}
+
+size_t BidStore::LiveRowCount() const {
+    return amounts.size() - freeRows.size();
+}
+
+//============================================================================
+// Columnar Binary Search Tree class definition
+//============================================================================
+
+// Row index that stands for "no row"
+const uint32_t noRow = 0xffffffff;
+
+// Child links of one row of a ColumnarBinarySearchTree; noRow when absent
+struct RowLinks {
+    uint32_t left;
+    uint32_t right;
+};
+
+/**
+ * Binary search tree whose bids live in a BidStore
+ *
+ * The tree has no node objects: row i of the store is node i, its bidId
+ * is read from the store, and its children are 32-bit row indexes in a
+ * pooled vector. Removing a bid unlinks its row and releases it for
+ * reuse.
+ */
+class ColumnarBinarySearchTree {
+
+private:
+    uint32_t root;
+    int size;
+    BidStore store;
+    vector<RowLinks> links;
+
+    void inOrder(uint32_t row, BidSink& sink, Bid& bid);
+    void range(uint32_t row, const string& lowId, const string& highId, vector<size_t>& rows);
+
+public:
+    ColumnarBinarySearchTree();
+    virtual ~ColumnarBinarySearchTree();
+    void Insert(Bid bid);
+    bool Remove(string bidId);
+    bool Search(string bidId, Bid& bid);
+    void Range(string lowId, string highId, vector<size_t>& rows);
+    void InOrder();
+    void InOrder(BidSink& sink);
+    void ShrinkToFit();
+    const BidStore& GetStore() const;
+    int GetSize();
+};
+
+/**
+ * Default constructor
+ */
+ColumnarBinarySearchTree::ColumnarBinarySearchTree() {
+    root = noRow;
+    size = 0;
+}
+
+/**
+ * Destructor; the rows and links are plain vectors, so nothing to walk
+ */
+ColumnarBinarySearchTree::~ColumnarBinarySearchTree() {
+}
+
+/**
+ * Insert a bid, storing it as a new or reused row
+ *
+ *@param bid The bid to be inserted
+ */
+void ColumnarBinarySearchTree::Insert(Bid bid) {
+    uint32_t row = store.Append(bid);
+    if (row == links.size())
+        links.push_back(RowLinks());
+    links[row].left = noRow;
+    links[row].right = noRow;
+    size++;
+
+    uint32_t* link = &root;
+    while (*link != noRow)
+        link = store.CompareKey(*link, bid.bidId) > 0 ? &links[*link].left : &links[*link].right;
+    *link = row;
+}
+
+/**
+ * Remove a bid from the tree
+ *
+ *@param bidId The bidId to be removed
+ * return true if a bid was removed
+ */
+bool ColumnarBinarySearchTree::Remove(string bidId) {
+    uint32_t* link = &root;
+    int order;
+    while (*link != noRow && (order = store.CompareKey(*link, bidId)) != 0)
+        link = order > 0 ? &links[*link].left : &links[*link].right;
+    uint32_t row = *link;
+    if (row == noRow)
+        return false;
+
+    if (links[row].left == noRow)
+        *link = links[row].right;
+    else if (links[row].right == noRow)
+        *link = links[row].left;
+    /// Two children: relink the in-order successor into the row's place
+    else {
+        uint32_t* succLink = &links[row].right;
+        while (links[*succLink].left != noRow)
+            succLink = &links[*succLink].left;
+        uint32_t succRow = *succLink;
+        *succLink = links[succRow].right;
+        links[succRow].left = links[row].left;
+        links[succRow].right = links[row].right;
+        *link = succRow;
+    }
+
+    size--;
+    store.Release(row);
+    return true;
+}
+
+/**
+ * Search for a bid
+ *
+ *@param bidId The bidId to look for
+ *@param bid Receives the bid rebuilt from the store when found
+ * return true if the bid was found
+ */
+bool ColumnarBinarySearchTree::Search(string bidId, Bid& bid) {
+    uint32_t row = root;
+    while (row != noRow) {
+        int order = store.CompareKey(row, bidId);
+        if (order == 0) {
+            bid = store.GetBid(row);
+            return true;
+        }
+        row = order > 0 ? links[row].left : links[row].right;
+    }
+    return false;
+}
+
+/**
+ * Collect the store rows whose bidId lies in [lowId, highId], in order
+ *
+ *@param lowId Smallest bidId to include
+ *@param highId Largest bidId to include
+ *@param rows Matching row indexes are appended here
+ */
+void ColumnarBinarySearchTree::Range(string lowId, string highId, vector<size_t>& rows) {
+    range(root, lowId, highId, rows);
+}
+
+/**
+ * Traverse the tree in order
+ */
+void ColumnarBinarySearchTree::InOrder() {
+    if (root == noRow) {
+        cout << "Tree is empty" << endl;
+        return;
+    }
+    BufferedBidWriter writer(cout, eDISPLAY);
+    InOrder(writer);
+}
+
+/**
+ * Traverse the tree in order
+ *
+ * Each row is rebuilt into the same Bid, so its strings are reused
+ * rather than reallocated for every row.
+ *
+ *@param sink Receives each bid; flushed at the end
+ */
+void ColumnarBinarySearchTree::InOrder(BidSink& sink) {
+    Bid bid;
+    if (root != noRow)
+        inOrder(root, sink, bid);
+    sink.Flush();
+}
+
+/**
+ * Release spare capacity after a bulk load
+ */
+void ColumnarBinarySearchTree::ShrinkToFit() {
+    store.ShrinkToFit();
+    links.shrink_to_fit();
+}
+
+const BidStore& ColumnarBinarySearchTree::GetStore() const {
+    return store;
+}
+
+int ColumnarBinarySearchTree::GetSize() {
+    return size;
+}
+
+/**
+ * Inorder tree traversal (recursive)
+ *
+ *@param row Current row in tree
+ */
+void ColumnarBinarySearchTree::inOrder(uint32_t row, BidSink& sink, Bid& bid) {
+    if (links[row].left != noRow)
+        inOrder(links[row].left, sink, bid);
+
+    store.CopyKey(row, bid.bidId);
+    store.CopyTitle(row, bid.title);
+    bid.fund = store.GetFundName(store.GetFundId(row));
+    bid.amount = store.Amounts()[row];
+    sink.Write(bid);
+
+    if (links[row].right != noRow)
+        inOrder(links[row].right, sink, bid);
+}
+
+/**
+ * Inorder traversal limited to a bidId range (recursive)
+ *
+ *@param row Current row in tree
+ *@param lowId Smallest bidId to include
+ *@param highId Largest bidId to include
+ *@param rows Matching row indexes are appended here
+ */
+void ColumnarBinarySearchTree::range(uint32_t row, const string& lowId, const string& highId, vector<size_t>& rows) {
+    if (row == noRow)
+        return;
+    if (store.CompareKey(row, lowId) > 0)
+        range(links[row].left, lowId, highId, rows);
+    if (store.CompareKey(row, lowId) >= 0 && store.CompareKey(row, highId) <= 0)
+        rows.push_back(row);
+    if (store.CompareKey(row, highId) <= 0)
+        range(links[row].right, lowId, highId, rows);
+}
+
+//============================================================================
+// Aggregate queries over bid amounts
+//============================================================================
+
+#if defined(AVX2_KERNELS)
+/**
+ * Whether the running CPU has AVX2, checked once
+ */
+bool hasAvx2() {
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+}
+
+/**
+ * AVX2 part of summarizeAmounts: whole groups of four
+ *
+ * @param amounts First amount
+ * @param count Number of amounts
+ * @param summary Summary to fill in
+ * return the number of amounts summarized
+ */
+__attribute__((target("avx2")))
+size_t summarizeAmountsAvx2(const double* amounts, size_t count, AmountSummary& summary) {
+    size_t i = 0;
+    __m256d sums = _mm256_setzero_pd();
+    __m256d mins = _mm256_set1_pd(summary.min);
+    __m256d maxs = _mm256_set1_pd(summary.max);
+    for (; i + 4 <= count; i += 4) {
+        __m256d values = _mm256_loadu_pd(amounts + i);
+        sums = _mm256_add_pd(sums, values);
+        mins = _mm256_min_pd(mins, values);
+        maxs = _mm256_max_pd(maxs, values);
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, sums);
+    summary.total = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm256_storeu_pd(lanes, mins);
+    summary.min = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+    _mm256_storeu_pd(lanes, maxs);
+    summary.max = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+    summary.count = i;
+    return i;
+}
+
+/**
+ * AVX2 part of histogramAmounts: whole groups of four
+ *
+ * Slots are clamped to [0, last] as doubles before the conversion, since
+ * out-of-range values would otherwise convert to INT_MIN.
+ *
+ * @param amounts First amount
+ * @param count Number of amounts
+ * @param low Lower edge of the first bucket
+ * @param scale Buckets per unit of amount
+ * @param buckets Buckets to count into
+ * return the number of amounts counted
+ */
+__attribute__((target("avx2")))
+size_t histogramAmountsAvx2(const double* amounts, size_t count, double low, double scale, vector<size_t>& buckets) {
+    size_t i = 0;
+    __m256d lows = _mm256_set1_pd(low);
+    __m256d scales = _mm256_set1_pd(scale);
+    __m256d zeros = _mm256_setzero_pd();
+    __m256d lasts = _mm256_set1_pd(buckets.size() - 1);
+    for (; i + 4 <= count; i += 4) {
+        __m256d slots = _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(amounts + i), lows), scales);
+        /// max_pd returns its second operand for NaN, which sends NaN to bucket 0 like the scalar path
+        slots = _mm256_min_pd(_mm256_max_pd(slots, zeros), lasts);
+        int lanes[4];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), _mm256_cvttpd_epi32(slots));
+        for (int lane = 0; lane < 4; lane++)
+            buckets[lanes[lane]]++;
+    }
+    return i;
+}
+#endif
+
+/**
+ * Summarize a contiguous array of amounts
+ *
+ * Four lanes at a time with AVX2 when the CPU has it, scalar otherwise
+ * and for the tail.
+ *
+ * @param amounts First amount
+ * @param count Number of amounts
+ */
+AmountSummary summarizeAmounts(const double* amounts, size_t count) {
+    AmountSummary summary;
+    size_t i = 0;
+
+#if defined(AVX2_KERNELS)
+    if (count >= 4 && hasAvx2())
+        i = summarizeAmountsAvx2(amounts, count, summary);
+#endif
+
+    for (; i < count; i++)
+        summary.Add(amounts[i]);
+    return summary;
+}
+
+/**
+ * Histogram of a contiguous array of amounts
+ *
+ * Buckets split [low, high] evenly; amounts outside it land in the first
+ * or last bucket.
+ *
+ * @param amounts First amount
+ * @param count Number of amounts
+ * @param low Lower edge of the first bucket
+ * @param high Upper edge of the last bucket
+ * @param bucketCount Number of buckets
+ */
+vector<size_t> histogramAmounts(const double* amounts, size_t count, double low, double high, int bucketCount) {
+    vector<size_t> buckets(bucketCount > 0 ? bucketCount : 1, 0);
+    int last = buckets.size() - 1;
+    double scale = high > low ? buckets.size() / (high - low) : 0.0;
+    size_t i = 0;
+
+#if defined(AVX2_KERNELS)
+    if (hasAvx2())
+        i = histogramAmountsAvx2(amounts, count, low, scale, buckets);
+#endif
+
+    for (; i < count; i++) {
+        double slot = (amounts[i] - low) * scale;
+        int bucket = slot > 0.0 ? (slot < last ? (int) slot : last) : 0;
+        buckets[bucket]++;
+    }
+    return buckets;
+}
+
+/**
+ * Summarize the amounts of every live row of a columnar store
+ *
+ * Uses the contiguous kernel while no rows are free, and skips the free
+ * rows otherwise, since they would count as zero amounts.
+ *
+ * @param store The store to scan
+ */
+AmountSummary summarizeStore(const BidStore& store) {
+    if (store.FreeRowCount() == 0)
+        return summarizeAmounts(store.Amounts(), store.RowCount());
+
+    AmountSummary summary;
+    const double* amounts = store.Amounts();
+    const uint8_t* live = store.LiveRows();
+    for (size_t row = 0; row < store.RowCount(); row++) {
+        if (live[row])
+            summary.Add(amounts[row]);
+    }
+    return summary;
+}
+
+/**
+ * Print an amount report: overall figures, a histogram and one line per fund
+ *
+ * @param report The report to print
+ */
+void displayAmountReport(const AmountReport& report) {
+    const AmountSummary& summary = report.overall;
+    if (summary.count == 0) {
+        cout << "No bids in range" << endl;
+        return;
+    }
+    cout << summary.count << " bids | total " << summary.total << " | average "
+            << summary.Average() << " | min " << summary.min << " | max " << summary.max << endl;
+
+    int bucketCount = report.histogram.size();
+    double width = (summary.max - summary.min) / bucketCount;
+    for (int i = 0; i < bucketCount; i++) {
+        cout << "  " << summary.min + i * width << " - " << summary.min + (i + 1) * width
+                << ": " << report.histogram[i] << endl;
+    }
+
+    for (auto const& fund : report.byFund) {
+        cout << fund.first << ": " << fund.second.count << " bids | total " << fund.second.total
+                << " | average " << fund.second.Average() << " | min " << fund.second.min
+                << " | max " << fund.second.max << endl;
+    }
+}
+
+//============================================================================
+// Bounded queue class definition
+//============================================================================
+
+/**
+ * Fixed-capacity lock-free queue for handing batches between threads
+ *
+ * Each cell carries a sequence number that says whether it is ready to be
+ * written or read for the current lap around the ring, so any number of
+ * producers and consumers can claim cells with a single compare-and-swap
+ * (Dmitry Vyukov's bounded MPMC queue). Push waits while the queue is
+ * full, which is what applies backpressure to the stage before it.
+ *
+ * Push and Pop yield a bounded number of times and then sleep on a
+ * condition variable, so a pipeline with more threads than cores does not
+ * keep its idle stages spinning. The sleep is timed, so a wakeup missed
+ * between the failed attempt and the wait costs at most one timeout.
+ */
+template <typename T>
+class BoundedQueue {
+
+private:
+    struct Cell {
+        atomic<size_t> sequence;
+        T value;
+    };
+
+    Cell* cells;
+    size_t mask;
+    alignas(64) atomic<size_t> head;
+    alignas(64) atomic<size_t> tail;
+    alignas(64) atomic<int> sleepers;
+    mutex sleepLock;
+    condition_variable changed;
+
+    void backOff(int attempt);
+    void wakeSleepers();
+
+public:
+    BoundedQueue(size_t capacity);
+    virtual ~BoundedQueue();
+    bool TryPush(T& value);
+    bool TryPop(T& value);
+    void Push(T value);
+    T Pop();
+};
+
+/**
+ * Constructor
+ *
+ *@param capacity Number of cells, rounded up to a power of two
+ */
+template <typename T>
+BoundedQueue<T>::BoundedQueue(size_t capacity) {
+    size_t cellCount = 2;
+    while (cellCount < capacity)
+        cellCount *= 2;
+    cells = new Cell[cellCount];
+    for (size_t i = 0; i < cellCount; i++)
+        cells[i].sequence.store(i, memory_order_relaxed);
+    mask = cellCount - 1;
+    head.store(0, memory_order_relaxed);
+    tail.store(0, memory_order_relaxed);
+    sleepers.store(0, memory_order_relaxed);
+}
+
+/**
+ * Destructor
+ */
+template <typename T>
+BoundedQueue<T>::~BoundedQueue() {
+    delete[] cells;
+}
+
+/**
+ * Move a value into the queue unless it is full
+ *
+ *@param value The value to enqueue, moved from on success
+ * return true if the value was enqueued
+ */
+template <typename T>
+bool BoundedQueue<T>::TryPush(T& value) {
+    Cell* cell;
+    size_t pos = head.load(memory_order_relaxed);
+    for (;;) {
+        cell = &cells[pos & mask];
+        size_t sequence = cell->sequence.load(memory_order_acquire);
+        intptr_t lap = (intptr_t) sequence - (intptr_t) pos;
+        if (lap == 0) {
+            if (head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                break;
+        }
+        else if (lap < 0)
+            return false;
+        else
+            pos = head.load(memory_order_relaxed);
+    }
+    cell->value = move(value);
+    cell->sequence.store(pos + 1, memory_order_release);
+    return true;
+}
+
+/**
+ * Move a value out of the queue unless it is empty
+ *
+ *@param value Receives the dequeued value
+ * return true if a value was dequeued
+ */
+template <typename T>
+bool BoundedQueue<T>::TryPop(T& value) {
+    Cell* cell;
+    size_t pos = tail.load(memory_order_relaxed);
+    for (;;) {
+        cell = &cells[pos & mask];
+        size_t sequence = cell->sequence.load(memory_order_acquire);
+        intptr_t lap = (intptr_t) sequence - (intptr_t) (pos + 1);
+        if (lap == 0) {
+            if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                break;
+        }
+        else if (lap < 0)
+            return false;
+        else
+            pos = tail.load(memory_order_relaxed);
+    }
+    value = move(cell->value);
+    cell->sequence.store(pos + mask + 1, memory_order_release);
+    return true;
+}
+
+/**
+ * Enqueue a value, waiting while the queue is full
+ */
+template <typename T>
+void BoundedQueue<T>::Push(T value) {
+    for (int attempt = 0; !TryPush(value); attempt++)
+        backOff(attempt);
+    wakeSleepers();
+}
+
+/**
+ * Dequeue a value, waiting while the queue is empty
+ */
+template <typename T>
+T BoundedQueue<T>::Pop() {
+    T value;
+    for (int attempt = 0; !TryPop(value); attempt++)
+        backOff(attempt);
+    wakeSleepers();
+    return value;
+}
+
+/**
+ * Wait after a failed attempt: yield at first, then sleep until the queue
+ * changes or a millisecond passes
+ *
+ *@param attempt Number of failed attempts so far
+ */
+template <typename T>
+void BoundedQueue<T>::backOff(int attempt) {
+    if (attempt < 64) {
+        this_thread::yield();
+        return;
+    }
+    unique_lock<mutex> lock(sleepLock);
+    sleepers.fetch_add(1);
+    changed.wait_for(lock, chrono::milliseconds(1));
+    sleepers.fetch_sub(1);
+}
+
+/**
+ * Wake the threads sleeping in backOff, if any
+ */
+template <typename T>
+void BoundedQueue<T>::wakeSleepers() {
+    if (sleepers.load() != 0) {
+        lock_guard<mutex> lock(sleepLock);
+        changed.notify_all();
+    }
+}
+
+//============================================================================
+// Static methods used for testing
+//============================================================================
+
+/**
+ * Error policy for csv::Parser: report a malformed row and skip it
+ *
+ * @param line Line of the file where the row starts
+ * @param reason What is wrong with the row
+ */
+bool reportBadRow(unsigned int line, const string& reason) {
+    std::cerr << "CSVparser : line " << line << ": " << reason << " (row skipped)" << std::endl;
+    return true;
+}
+
+/**
+ * Load a CSV file containing bids into a container
+ *
+ * @param csvPath the path to the CSV file to load
+ * return a container holding all the bids read
+ */
+void loadBids(string csvPath, BinarySearchTree* bst) {
+    cout << "Loading CSV file " << csvPath << endl;
+
+    // initialize the CSV Parser using the given path
+    csv::Parser file = csv::Parser(csvPath, csv::eFILE, ',', reportBadRow);
+
+    // read and display header row - optional
+    vector<string> header = file.getHeader();
+    for (auto const& c : header) {
+        cout << c << " | ";
+    }
+    cout << "" << endl;
+
+    try {
+        // loop to read rows of a CSV file
+        for (unsigned int i = 0; i < file.rowCount(); i++) {
+
+            // Create a data structure and add to the collection of bids
+            Bid bid = parseBid(file[i]);
+
+            //cout << "Item: " << bid.title << ", Fund: " << bid.fund << ", Amount: " << bid.amount << endl;
+
+            // push this bid to the end
+            bst->Insert(bid);
+        }
+    } catch (csv::Error &e) {
+        std::cerr << e.what() << std::endl;
+    }
+}
+
+/**
+ * Load a CSV file containing bids into a sharded container
+ *
+ * All rows are converted first and then inserted as one batch, so each
+ * shard is filled by its own thread.
+ *
+ * @param csvPath the path to the CSV file to load
+ * @param tree the sharded container to fill
+ * return the wall time of the batch insert in seconds, parsing excluded
+ */
+double loadBids(string csvPath, ShardedBinarySearchTree* tree) {
+    cout << "Loading CSV file " << csvPath << endl;
+
+    // initialize the CSV Parser using the given path
+    csv::Parser file = csv::Parser(csvPath, csv::eFILE, ',', reportBadRow);
+
+    vector<Bid> bids;
+    try {
+        bids.reserve(file.rowCount());
+        for (unsigned int i = 0; i < file.rowCount(); i++)
+            bids.push_back(parseBid(file[i]));
+    } catch (csv::Error &e) {
+        std::cerr << e.what() << std::endl;
+    }
+
+    auto started = chrono::steady_clock::now();
+    tree->InsertBatch(bids);
+    return chrono::duration<double>(chrono::steady_clock::now() - started).count();
+}
+
+/**
+ * Load a CSV file containing bids into columnar storage
+ *
+ * @param csvPath the path to the CSV file to load
+ * @param tree the columnar tree to fill
+ */
+void loadBids(string csvPath, ColumnarBinarySearchTree* tree) {
+    cout << "Loading CSV file " << csvPath << endl;
+
+    // initialize the CSV Parser using the given path
+    csv::Parser file = csv::Parser(csvPath, csv::eFILE, ',', reportBadRow);
+
+    try {
+        for (unsigned int i = 0; i < file.rowCount(); i++)
+            tree->Insert(parseBid(file[i]));
+    } catch (csv::Error &e) {
+        std::cerr << e.what() << std::endl;
+    }
+    tree->ShrinkToFit();
+}
+
+// Raw lines of the CSV file handed from the reader to the parsers
+struct LineBatch {
+    size_t sequence;
+    bool last;
+    unsigned int firstLine; // line of the file the batch starts on
+    string lines;
+    LineBatch() {
+        sequence = 0;
+        last = false;
+        firstLine = 0;
+    }
+};
+
+// Parsed bids handed from the parsers to the inserter
+struct BidBatch {
+    size_t sequence;
+    bool last;
+    vector<Bid> bids;
+    BidBatch() {
+        sequence = 0;
+        last = false;
+    }
+};
+
+// Work done and time spent working (not waiting) by one pipeline stage
+struct StageStats {
+    size_t rows;
+    size_t bytes;
+    double busySeconds;
+    StageStats() {
+        rows = 0;
+        bytes = 0;
+        busySeconds = 0.0;
+    }
+};
+
+/**
+ * Load a CSV file containing bids with reading, parsing and insertion overlapped
+ *
+ * The reader thread cuts the file into batches of whole records, a pool of
+ * parser threads turns each batch into bids with csv::Parser, and the
+ * calling thread inserts them. Stages are joined by bounded queues, so a
+ * slow stage holds back the ones before it instead of buffering the whole
+ * file. The inserter applies batches in file order, so the tree comes out
+ * the same as with loadBids. Malformed rows are reported and skipped
+ * rather than ending the load.
+ *
+ * @param csvPath the path to the CSV file to load
+ * @param bst the tree to fill
+ * @param parserCount number of parser threads
+ */
+void loadBidsPipelined(string csvPath, BinarySearchTree* bst, int parserCount) {
+    cout << "Loading CSV file " << csvPath << endl;
+
+    const size_t batchBytes = 256 * 1024;
+    const size_t queueDepth = 16;
+    if (parserCount < 1)
+        parserCount = 1;
+
+    ifstream file(csvPath.c_str(), ios::binary);
+    string header;
+    if (!file.is_open() || !getline(file, header) || header.empty()) {
+        std::cerr << "CSVparser : Failed to open " << csvPath << std::endl;
+        return;
+    }
+    cout << header << endl;
+
+    BoundedQueue<LineBatch> lineQueue(queueDepth);
+    BoundedQueue<BidBatch> bidQueue(queueDepth);
+    StageStats readerStats;
+    vector<StageStats> parserStats(parserCount);
+    StageStats inserterStats;
+    auto wallStart = chrono::steady_clock::now();
+
+    /// Reader: fixed-size block reads cut back to the last record boundary
+    thread reader([&]() {
+        vector<char> block(batchBytes);
+        string carry;
+        size_t sequence = 0;
+        unsigned int nextLine = 2;
+        /// Tokenizer state carried across blocks, following the rules of csv::Parser:
+        /// a quote only opens a field at its start, and after a bad quoted field
+        /// the rest of the line is skipped
+        enum { eFIELD_START, eUNQUOTED, eQUOTED, eQUOTE_SEEN, eSKIP } state = eFIELD_START;
+        auto started = chrono::steady_clock::now();
+        while (file) {
+            file.read(block.data(), block.size());
+            size_t got = file.gcount();
+            if (got == 0)
+                break;
+            readerStats.bytes += got;
+
+            size_t end = got;
+            if (file) {
+                end = 0;
+                for (size_t i = 0; i < got; i++) {
+                    char c = block[i];
+                    if (state == eQUOTED) {
+                        if (c == '"')
+                            state = eQUOTE_SEEN;
+                        continue;
+                    }
+                    if (state == eQUOTE_SEEN) {
+                        if (c == '"') {
+                            state = eQUOTED;
+                            continue;
+                        }
+                        state = (c == ',' || c == '\n') ? eUNQUOTED : eSKIP;
+                    }
+                    if (c == '\n') {
+                        end = i + 1;
+                        state = eFIELD_START;
+                    } else if (state != eSKIP) {
+                        if (c == ',')
+                            state = eFIELD_START;
+                        else if (c == '"' && state == eFIELD_START)
+                            state = eQUOTED;
+                        else
+                            state = eUNQUOTED;
+                    }
+                }
+            }
+
+            /// No record ends in this block yet, keep it for the next one
+            if (end == 0) {
+                carry.append(block.data(), got);
+                continue;
+            }
+
+            LineBatch batch;
+            batch.sequence = sequence++;
+            batch.firstLine = nextLine;
+            batch.lines.swap(carry);
+            batch.lines.append(block.data(), end);
+            carry.assign(block.data() + end, got - end);
+            nextLine += count(batch.lines.begin(), batch.lines.end(), '\n');
+
+            readerStats.busySeconds += chrono::duration<double>(chrono::steady_clock::now() - started).count();
+            lineQueue.Push(move(batch));
+            started = chrono::steady_clock::now();
+        }
+        if (!carry.empty()) {
+            LineBatch batch;
+            batch.sequence = sequence++;
+            batch.firstLine = nextLine;
+            batch.lines.swap(carry);
+            lineQueue.Push(move(batch));
+        }
+        readerStats.busySeconds += chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+        /// One end marker per parser
+        for (int i = 0; i < parserCount; i++) {
+            LineBatch batch;
+            batch.last = true;
+            lineQueue.Push(move(batch));
+        }
+    });
+
+    /// Parsers: each batch is parsed as pure content under the file's header
+    vector<thread> parsers;
+    for (int p = 0; p < parserCount; p++) {
+        parsers.push_back(thread([&, p]() {
+            for (;;) {
+                LineBatch lines = lineQueue.Pop();
+                BidBatch batch;
+                batch.sequence = lines.sequence;
+                batch.last = lines.last;
+                if (!lines.last) {
+                    auto started = chrono::steady_clock::now();
+                    try {
+                        /// The header is line 1 of the content, the batch starts on line 2
+                        unsigned int firstLine = lines.firstLine;
+                        csv::Parser content(header + "\n" + lines.lines, csv::ePURE, ',',
+                                [firstLine](unsigned int line, const string& reason) {
+                                    return reportBadRow(firstLine + line - 2, reason);
+                                });
+                        batch.bids.reserve(content.rowCount());
+                        for (unsigned int i = 0; i < content.rowCount(); i++)
+                            batch.bids.push_back(parseBid(content[i]));
+                    } catch (csv::Error &e) {
+                        std::cerr << e.what() << " (batch from line " << lines.firstLine << " skipped)" << std::endl;
+                        batch.bids.clear();
+                    }
+                    parserStats[p].rows += batch.bids.size();
+                    parserStats[p].bytes += lines.lines.size();
+                    parserStats[p].busySeconds += chrono::duration<double>(chrono::steady_clock::now() - started).count();
+                }
+                bidQueue.Push(move(batch));
+                if (lines.last)
+                    return;
+            }
+        }));
+    }
+
+    /// Inserter: apply batches in file order, holding any that arrive early
+    map<size_t, vector<Bid>> early;
+    size_t nextSequence = 0;
+    int parsersDone = 0;
+    while (parsersDone < parserCount) {
+        BidBatch batch = bidQueue.Pop();
+        if (batch.last) {
+            parsersDone++;
+            continue;
+        }
+        early[batch.sequence].swap(batch.bids);
+
+        auto started = chrono::steady_clock::now();
+        for (auto next = early.begin(); next != early.end() && next->first == nextSequence; next = early.begin()) {
+            for (auto const& bid : next->second)
+                bst->Insert(bid);
+            inserterStats.rows += next->second.size();
+            early.erase(next);
+            nextSequence++;
+        }
+        inserterStats.busySeconds += chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    }
+
+    reader.join();
+    for (auto& parser : parsers)
+        parser.join();
+    double wallSeconds = chrono::duration<double>(chrono::steady_clock::now() - wallStart).count();
+
+    StageStats parsing;
+    for (auto const& stats : parserStats) {
+        parsing.rows += stats.rows;
+        parsing.bytes += stats.bytes;
+        parsing.busySeconds += stats.busySeconds;
+    }
+    cout << "reader: " << readerStats.bytes / 1048576.0 << " MB in " << readerStats.busySeconds << " s busy ("
+            << readerStats.bytes / 1048576.0 / max(readerStats.busySeconds, 1e-9) << " MB/s)" << endl;
+    cout << "parsers: " << parsing.rows << " rows in " << parsing.busySeconds << " s busy over " << parserCount
+            << " threads (" << parsing.rows / max(parsing.busySeconds, 1e-9) << " rows/s per thread)" << endl;
+    cout << "inserter: " << inserterStats.rows << " rows in " << inserterStats.busySeconds << " s busy ("
+            << inserterStats.rows / max(inserterStats.busySeconds, 1e-9) << " rows/s)" << endl;
+    cout << "pipeline: " << wallSeconds << " s wall" << endl;
+}
+
+/**
+ * Write every bid in the tree to a file, in bidId order
+ *
+ * @param bst The tree to export
+ * @param path The file to create or overwrite
+ * @param format CSV, pipe-delimited or JSON lines
+ */
+void exportBids(BinarySearchTree* bst, string path, BidFormat format) {
+    ofstream file(path.c_str(), ios::out | ios::trunc | ios::binary);
+    if (!file.is_open()) {
+        cout << "Failed to open " << path << endl;
+        return;
+    }
+    {
+        BufferedBidWriter header(file, format);
+        header.WriteHeader();
+    }
+    bst->ParallelInOrder(file, format, thread::hardware_concurrency());
+    cout << bst->GetSize() << " bids written to " << path << endl;
+}
+
+/**
+ * Convert one CSV row of the monthly sales file into a bid
+ *
+ * @param row The parsed row
+ */
+Bid parseBid(const csv::Row& row) {
+    Bid bid;
+    bid.bidId = row[1];
+    bid.title = row[0];
+    bid.fund = row[8];
+    bid.amount = strToDouble(row[4], '$');
+    return bid;
+}
+
+/**
+ * Simple C function to convert a string to a double
+ * after stripping out unwanted char
+ *
+ * credit: http://stackoverflow.com/a/24875936
+ *
+ * @param ch The character to strip out
+ */
+double strToDouble(string str, char ch) {
+    str.erase(remove(str.begin(), str.end(), ch), str.end());
+    return atof(str.c_str());
+}
+
+/**
+ * Current resident set size of this process in kilobytes
+ *
+ * Read from /proc/self/statm where it exists; elsewhere falls back to the
+ * peak from getrusage, which never goes down.
+ */
+long residentMemoryKb() {
+#if defined(__linux__)
+    ifstream statm("/proc/self/statm");
+    long pages, resident;
+    if (statm >> pages >> resident)
+        return resident * (sysconf(_SC_PAGESIZE) / 1024);
+#endif
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+/**
+ * Heap bytes currently allocated by this process
+ *
+ * From mallinfo2 on glibc 2.33 and later, which counts live allocations
+ * only; elsewhere falls back to the resident size.
+ */
+size_t heapBytesInUse() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+#else
+    return residentMemoryKb() * 1024;
+#endif
+}
+
+/**
+ * Long-running insert/remove churn against a tree of fixed size
+ *
+ * Every round removes and re-inserts liveCount random bids. Removed nodes
+ * are recycled, so the resident memory printed per round should stay flat.
+ *
+ * @param liveCount Number of bids kept in the tree
+ * @param rounds Number of churn rounds to run
+ */
+void churnBenchmark(int liveCount, int rounds) {
+    BinarySearchTree* bst = new BinarySearchTree();
+    vector<string> liveIds;
+    unsigned long nextId = 0;
+
+    srand(1);
+    for (int i = 0; i < liveCount; i++) {
+        Bid bid;
+        bid.bidId = to_string(((unsigned long)rand() << 20) ^ nextId++);
+        bid.title = "churn";
+        bst->Insert(bid);
+        liveIds.push_back(bid.bidId);
+    }
+    cout << "churn: " << bst->GetSize() << " bids, " << residentMemoryKb() << " KB resident" << endl;
+
+    for (int round = 1; round <= rounds; round++) {
+        clock_t ticks = clock();
+        for (int i = 0; i < liveCount; i++) {
+            size_t victim = rand() % liveIds.size();
+            bst->Remove(liveIds[victim]);
+
+            Bid bid;
+            bid.bidId = to_string(((unsigned long)rand() << 20) ^ nextId++);
+            bid.title = "churn";
+            bst->Insert(bid);
+            liveIds[victim] = bid.bidId;
+        }
+        ticks = clock() - ticks;
+        cout << "round " << round << ": " << bst->GetSize() << " bids, "
+                << ticks * 1.0 / CLOCKS_PER_SEC << " seconds, "
+                << residentMemoryKb() << " KB resident" << endl;
+    }
+
+    delete bst;
+}
+
+/**
+ * Duplicate bidIds: insert and remove repeated keys in the trees that
+ * allow them and compare with a count per bidId
+ *
+ * Which of several equal bids a Remove takes is unspecified, so only the
+ * bidIds are compared.
+ *
+ * @param operations Number of random operations
+ * return a description of the first mismatch, empty if none
+ */
+string checkDuplicates(int operations) {
+    BinarySearchTree plain;
+    BinarySearchTree indexed;
+    indexed.EnableIndex();
+    ShardedBinarySearchTree sharded(4);
+    ColumnarBinarySearchTree columnar;
+    map<string, int> oracle;
+    int total = 0;
+    const int keySpace = 200;
+
+    /// A batch of repeated keys first, so the sharded splits see duplicates
+    vector<Bid> batch;
+    for (int i = 0; i < keySpace; i++) {
+        Bid bid;
+        bid.bidId = to_string(rand() % keySpace);
+        bid.title = "duplicate " + to_string(i);
+        batch.push_back(bid);
+        plain.Insert(bid);
+        indexed.Insert(bid);
+        columnar.Insert(bid);
+        oracle[bid.bidId]++;
+        total++;
+    }
+    sharded.InsertBatch(batch);
+
+    for (int op = 0; op < operations; op++) {
+        string bidId = to_string(rand() % keySpace);
+        if (rand() % 2) {
+            Bid bid;
+            bid.bidId = bidId;
+            bid.title = "duplicate " + to_string(op);
+            plain.Insert(bid);
+            indexed.Insert(bid);
+            sharded.Insert(bid);
+            columnar.Insert(bid);
+            oracle[bidId]++;
+            total++;
+        } else {
+            bool expected = oracle[bidId] > 0;
+            if (expected) {
+                oracle[bidId]--;
+                total--;
+            }
+            if (plain.Remove(bidId) != expected || indexed.Remove(bidId) != expected
+                    || sharded.Remove(bidId) != expected || columnar.Remove(bidId) != expected)
+                return "duplicate Remove " + bidId;
+        }
+
+        bool present = oracle[bidId] > 0;
+        Bid found;
+        if ((plain.Search(bidId) != nullptr) != present || (indexed.Search(bidId) != nullptr) != present
+                || sharded.Search(bidId, found) != present || columnar.Search(bidId, found) != present)
+            return "duplicate Search " + bidId;
+        if (plain.GetSize() != total || indexed.GetSize() != total
+                || sharded.GetSize() != total || columnar.GetSize() != total)
+            return "duplicate GetSize";
+
+        if (op % 1000 == 0 || op == operations - 1) {
+            vector<string> expectedIds;
+            for (auto const& key : oracle)
+                expectedIds.insert(expectedIds.end(), key.second, key.first);
+            CollectingSink plainBids, indexedBids, shardedBids, columnarBids;
+            plain.InOrder(plainBids);
+            indexed.InOrder(indexedBids);
+            sharded.InOrder(shardedBids);
+            columnar.InOrder(columnarBids);
+            for (CollectingSink* sink : { &plainBids, &indexedBids, &shardedBids, &columnarBids }) {
+                if (sink->bids.size() != expectedIds.size())
+                    return "duplicate InOrder size";
+                for (size_t i = 0; i < expectedIds.size(); i++) {
+                    if (sink->bids[i].bidId != expectedIds[i])
+                        return "duplicate InOrder order";
+                }
+            }
+            if (!plain.CheckInvariants() || !indexed.CheckInvariants())
+                return "duplicate CheckInvariants";
         }
-        /// bidId is greater than current node's bidId
-        else
-            curNode = curNode->right;
     }
-    
-    return nullptr;
+    return "";
 }
 
 /**
- * Display the bid information to the console (std::out)
+ * Compare a traversal's bids with the oracle, every field exactly
  *
- * @param bid struct containing the bid info
+ * @param bids The bids in traversal order
+ * @param oracle The expected bids
+ * return true if they match
  */
-void BinarySearchTree::DisplayBid(Bid bid) {
-    cout << bid.bidId << ": " << bid.title << " | " << bid.amount << " | "
-            << bid.fund << endl;
-    return;
-}
-
-int BinarySearchTree::GetSize() {
-    return size;
+bool matchesOracle(const vector<Bid>& bids, const map<string, Bid>& oracle) {
+    if (bids.size() != oracle.size())
+        return false;
+    size_t i = 0;
+    for (auto const& entry : oracle) {
+        const Bid& bid = bids[i++];
+        if (bid.bidId != entry.first || bid.title != entry.second.title
+                || bid.fund != entry.second.fund || bid.amount != entry.second.amount)
+            return false;
+    }
+    return true;
 }
 
 /**
- * Add a bid to some node (recursive)
+ * Large-tree pass over the parallel and I/O paths
  *
- * @param curNode Current node in tree
- * @param bid Bid to be added
+ * Builds a tree past the size where the parallel code splits work and
+ * checks against a std::map oracle, with titles holding separators,
+ * quotes and line breaks:
+ * - ParallelInOrder CSV and pipe output parsed back with csv::Parser
+ * - ParallelInOrder JSON output byte-identical to the serial writer
+ * - ParallelVisit reaching every bid exactly once
+ * - loadBids and loadBidsPipelined reading a file written from the oracle
+ * - DestroyParallel emptying the tree
+ * Several threads are used even on a single core.
+ *
+ * @param bidCount Number of bids in the tree
+ * @param seed Names the temporary CSV file
+ * return a description of the first mismatch, empty if none
  */
-void BinarySearchTree::addNode(Node* curNode, Bid bid) {
-    /// Find the bid's spot in the Tree by recursive searching the nodes for its appropriate location
-    /// Add node to left subtree
-    if (curNode->bid.bidId > bid.bidId) {
-        if (curNode->left == nullptr) {
-            curNode->left = new Node(bid);
-            size++;
+string checkLargeTree(int bidCount, unsigned int seed) {
+    const int threadCount = 4;
+    const char* oddTitles[] = { ", with a comma", " \"quoted\"", " two\nlines", " pipe|bar", " cr\r\nlf" };
+    /// Shuffled insertion order keeps the unbalanced tree shallow
+    vector<Bid> bids(bidCount);
+    for (int i = 0; i < bidCount; i++) {
+        bids[i].bidId = to_string(i);
+        bids[i].title = "bid " + to_string(i) + (i % 7 == 0 ? oddTitles[i / 7 % 5] : "");
+        bids[i].fund = "fund " + to_string(rand() % 30);
+        /// Amounts with no short decimal form, so output must keep all digits
+        bids[i].amount = rand() % 100000000 / 7.0;
+    }
+    for (int i = bidCount - 1; i > 0; i--)
+        swap(bids[i], bids[rand() % (i + 1)]);
+    BinarySearchTree* bst = new BinarySearchTree();
+    map<string, Bid> oracle;
+    for (auto const& bid : bids) {
+        bst->Insert(bid);
+        oracle[bid.bidId] = bid;
+    }
+
+    /// CSV and pipe output must parse back to the same bids
+    const BidFormat delimited[] = { eCSV, ePIPE };
+    for (BidFormat format : delimited) {
+        ostringstream text;
+        {
+            BufferedBidWriter header(text, format);
+            header.WriteHeader();
         }
-        else
-            this->addNode(curNode->left, bid);
+        bst->ParallelInOrder(text, format, threadCount);
+        vector<Bid> parsed;
+        try {
+            csv::Parser content(text.str(), csv::ePURE, format == eCSV ? ',' : '|');
+            for (unsigned int i = 0; i < content.rowCount(); i++) {
+                Bid bid;
+                bid.bidId = content[i][0];
+                bid.title = content[i][1];
+                bid.amount = strtod(content[i][2].c_str(), nullptr);
+                bid.fund = content[i][3];
+                parsed.push_back(bid);
+            }
+        } catch (csv::Error &e) {
+            return string("ParallelInOrder output does not parse: ") + e.what();
+        }
+        if (!matchesOracle(parsed, oracle))
+            return format == eCSV ? "ParallelInOrder CSV" : "ParallelInOrder pipe";
     }
-    /// Add node to right subtree
-    else {
-        if (curNode->right == nullptr) {
-            curNode->right = new Node(bid);
-            size++;
+
+    ostringstream parallelJson, serialJson;
+    bst->ParallelInOrder(parallelJson, eJSON, threadCount);
+    {
+        BufferedBidWriter writer(serialJson, eJSON);
+        bst->InOrder(writer);
+    }
+    if (parallelJson.str() != serialJson.str())
+        return "ParallelInOrder JSON";
+
+    vector<CollectingSink> visitors(threadCount);
+    vector<BidSink*> sinks;
+    for (auto& visitor : visitors)
+        sinks.push_back(&visitor);
+    bst->ParallelVisit(sinks);
+    vector<Bid> visited;
+    for (auto const& visitor : visitors)
+        visited.insert(visited.end(), visitor.bids.begin(), visitor.bids.end());
+    sort(visited.begin(), visited.end(), [](const Bid& a, const Bid& b) { return a.bidId < b.bidId; });
+    if (!matchesOracle(visited, oracle))
+        return "ParallelVisit";
+
+    /// Write the oracle in the monthly sales layout and load it back both ways
+    string path = "selfcheck-" + to_string(seed) + ".csv";
+    {
+        ofstream file(path.c_str(), ios::out | ios::trunc | ios::binary);
+        file << "ArticleTitle,ArticleID,Department,CloseDate,WinningBid,InventoryID,VehicleID,ReceiptNumber,Fund\n";
+        for (auto const& bid : bids) {
+            string title = bid.title;
+            for (size_t at = title.find('"'); at != string::npos; at = title.find('"', at + 2))
+                title.insert(at, 1, '"');
+            char amount[32];
+            snprintf(amount, sizeof(amount), "$%.17g", bid.amount);
+            file << '"' << title << "\"," << bid.bidId << ",Dept,1/1/2016," << amount
+                    << ",,,," << bid.fund << "\n";
         }
-        else
-            this->addNode(curNode->right, bid);
     }
+    BinarySearchTree serialLoad;
+    BinarySearchTree pipelinedLoad;
+    streambuf* console = cout.rdbuf(nullptr);
+    loadBids(path, &serialLoad);
+    loadBidsPipelined(path, &pipelinedLoad, threadCount - 1);
+    cout.rdbuf(console);
+    std::remove(path.c_str());
+    CollectingSink serialBids, pipelinedBids;
+    serialLoad.InOrder(serialBids);
+    pipelinedLoad.InOrder(pipelinedBids);
+    if (!matchesOracle(serialBids.bids, oracle))
+        return "loadBids";
+    if (!matchesOracle(pipelinedBids.bids, oracle))
+        return "loadBidsPipelined";
+
+    bst->DestroyParallel(threadCount);
+    if (bst->GetSize() != 0)
+        return "DestroyParallel";
+    delete bst;
+    return "";
 }
+
 /**
- * Inorder tree traversal (recursive)
+ * Randomized differential check of the trees against std::map
  *
- *@param node Current node in tree
+ * Drives a plain tree, an indexed tree, the persistent tree, a sharded
+ * tree and a columnar tree through the same random Insert/Remove/Search
+ * sequence as a std::map oracle, checking every answer, and periodically
+ * compares full traversals, ranges, ranged totals and the structural
+ * invariants. One batch insert early on makes the sharded tree choose
+ * its splits after some single inserts have landed in shard 0. Then
+ * runs the duplicate-bidId and large-tree passes.
+ *
+ * @param operations Number of random operations
+ * @param seed Seed for the operation sequence, printed on failure
+ * return true if every check passed
  */
-void BinarySearchTree::inOrder(Node* node) {
-    if (node == nullptr) {
-        cout << "Tree is empty" << endl;
-        return;
+bool selfCheck(int operations, unsigned int seed) {
+    BinarySearchTree plain;
+    BinarySearchTree indexed;
+    indexed.EnableIndex();
+    PersistentBinarySearchTree persistent;
+    ShardedBinarySearchTree sharded(4);
+    ColumnarBinarySearchTree columnar;
+    map<string, Bid> oracle;
+    const int keySpace = 2000;
+    const int batchAt = min(1000, operations / 2);
+
+    /// Insert into every single-bid container and the oracle
+    auto insertBid = [&](const Bid& bid) {
+        plain.Insert(bid);
+        indexed.Insert(bid);
+        persistent.Insert(bid);
+        columnar.Insert(bid);
+        oracle[bid.bidId] = bid;
+    };
+
+    srand(seed);
+    for (int op = 0; op < operations; op++) {
+        string bidId = to_string(rand() % keySpace);
+        string failure;
+
+        if (op == batchAt) {
+            vector<Bid> batch;
+            for (int i = 0; i < 200; i++) {
+                Bid bid;
+                bid.bidId = to_string(rand() % keySpace);
+                if (oracle.find(bid.bidId) != oracle.end())
+                    continue;
+                bid.title = "batch " + to_string(i);
+                bid.fund = "fund " + to_string(rand() % 8);
+                bid.amount = (rand() % 100000) / 100.0;
+                insertBid(bid);
+                batch.push_back(bid);
+            }
+            sharded.InsertBatch(batch);
+        }
+
+        switch (rand() % 4) {
+        case 0:
+        case 1:
+            /// Insert a new bid; the oracle holds one bid per bidId
+            if (oracle.find(bidId) == oracle.end()) {
+                Bid bid;
+                bid.bidId = bidId;
+                bid.title = "bid " + to_string(op);
+                bid.fund = "fund " + to_string(rand() % 8);
+                bid.amount = (rand() % 100000) / 100.0;
+                insertBid(bid);
+                sharded.Insert(bid);
+            }
+            break;
+        case 2: {
+            bool expected = oracle.erase(bidId) > 0;
+            if (plain.Remove(bidId) != expected || indexed.Remove(bidId) != expected
+                    || sharded.Remove(bidId) != expected || columnar.Remove(bidId) != expected)
+                failure = "Remove " + bidId;
+            Version before = persistent.Snapshot();
+            if (failure.empty() && (persistent.Remove(bidId) != before) != expected)
+                failure = "Persistent Remove " + bidId;
+            break;
+        }
+        default: {
+            auto found = oracle.find(bidId);
+            Node* plainNode = plain.Search(bidId);
+            Node* indexedNode = indexed.Search(bidId);
+            const PersistentNode* persistentNode = PersistentBinarySearchTree::Search(persistent.Snapshot(), bidId);
+            Bid shardedBid, columnarBid;
+            bool shardedFound = sharded.Search(bidId, shardedBid);
+            bool columnarFound = columnar.Search(bidId, columnarBid);
+            if (found == oracle.end()) {
+                if (plainNode != nullptr || indexedNode != nullptr || persistentNode != nullptr
+                        || shardedFound || columnarFound)
+                    failure = "Search found missing " + bidId;
+            }
+            else if (plainNode == nullptr || indexedNode == nullptr || persistentNode == nullptr
+                    || !shardedFound || !columnarFound
+                    || plainNode->bid.title != found->second.title
+                    || indexedNode->bid.title != found->second.title
+                    || persistentNode->bid.title != found->second.title
+                    || shardedBid.title != found->second.title
+                    || columnarBid.title != found->second.title
+                    || columnarBid.fund != found->second.fund
+                    || columnarBid.amount != found->second.amount)
+                failure = "Search " + bidId;
+            break;
+        }
+        }
+
+        if (failure.empty() && (plain.GetSize() != (int) oracle.size() || indexed.GetSize() != (int) oracle.size()
+                || sharded.GetSize() != (int) oracle.size() || columnar.GetSize() != (int) oracle.size()))
+            failure = "GetSize";
+
+        /// Full comparison every so often
+        if (failure.empty() && (op % 1000 == 0 || op == operations - 1)) {
+            CollectingSink plainBids, persistentBids, shardedBids, columnarBids;
+            plain.InOrder(plainBids);
+            PersistentBinarySearchTree::InOrder(persistent.Snapshot(), persistentBids);
+            sharded.InOrder(shardedBids);
+            columnar.InOrder(columnarBids);
+            if (plainBids.bids.size() != oracle.size() || persistentBids.bids.size() != oracle.size()
+                    || shardedBids.bids.size() != oracle.size() || columnarBids.bids.size() != oracle.size())
+                failure = "InOrder size";
+            size_t i = 0;
+            for (auto it = oracle.begin(); failure.empty() && it != oracle.end(); ++it, ++i) {
+                if (plainBids.bids[i].bidId != it->first || persistentBids.bids[i].bidId != it->first
+                        || shardedBids.bids[i].bidId != it->first || columnarBids.bids[i].bidId != it->first)
+                    failure = "InOrder order";
+                else if (columnarBids.bids[i].title != it->second.title
+                        || columnarBids.bids[i].fund != it->second.fund
+                        || columnarBids.bids[i].amount != it->second.amount)
+                    failure = "InOrder columnar payload " + it->first;
+            }
+
+            string lowId = to_string(rand() % keySpace);
+            string highId = to_string(rand() % keySpace);
+            if (highId < lowId)
+                swap(lowId, highId);
+            int count;
+            double total = plain.RangeTotal(lowId, highId, count);
+            double expected = 0.0;
+            int expectedCount = 0;
+            for (auto it = oracle.lower_bound(lowId); it != oracle.end() && it->first <= highId; ++it) {
+                expected += it->second.amount;
+                expectedCount++;
+            }
+            if (failure.empty() && (count != expectedCount || fabs(total - expected) > 1e-6 * max(1.0, expected)))
+                failure = "RangeTotal " + lowId + ".." + highId;
+
+            vector<Bid> shardedRange;
+            vector<size_t> columnarRows;
+            sharded.Range(lowId, highId, shardedRange);
+            columnar.Range(lowId, highId, columnarRows);
+            if (failure.empty() && ((int) shardedRange.size() != expectedCount || (int) columnarRows.size() != expectedCount))
+                failure = "Range " + lowId + ".." + highId;
+
+            if (failure.empty() && (!plain.CheckInvariants() || !indexed.CheckInvariants()))
+                failure = "CheckInvariants";
+        }
+
+        if (!failure.empty()) {
+            cout << "self check failed at operation " << op << " (seed " << seed << "): " << failure << endl;
+            cout << "replay with --self-check " << seed << " " << operations << endl;
+            return false;
+        }
     }
-    if (node->left != nullptr)
-        inOrder(node->left);
-        
-    DisplayBid(node->bid);
-    
-    if (node->right != nullptr)
-        inOrder(node->right);
+
+    string failure = checkDuplicates(operations / 4);
+    if (failure.empty())
+        failure = checkLargeTree(100000, seed);
+    if (!failure.empty()) {
+        cout << "self check failed after " << operations << " operations (seed " << seed << "): " << failure << endl;
+        cout << "replay with --self-check " << seed << " " << operations << endl;
+        return false;
+    }
+
+    cout << "self check passed: " << operations << " operations (seed " << seed << ")" << endl;
+    return true;
 }
+
 /**
- * Post-order tree traversal (recursive)
+ * The csv::Parser code path as it was before the single-pass tokenizer
  *
- *@param node Current node in tree
+ * Kept only as the benchmark baseline: getline into a vector of lines,
+ * the header split with a stringstream, then one csv::Row per line split
+ * on commas outside quotes, throwing on a field-count mismatch.
+ *
+ * @param csvPath The file to parse
+ * @param bytes Receives the number of bytes read
+ * return the number of rows
  */
-void BinarySearchTree::postOrder(Node* node) {
-    if (node == nullptr) {
-        cout << "Tree is empty" << endl;
-        return;
+size_t baselineCsvParse(const string& csvPath, size_t& bytes) {
+    ifstream file(csvPath.c_str());
+    if (!file.is_open())
+        throw csv::Error(string("Failed to open ").append(csvPath));
+    vector<string> originalFile;
+    string line;
+    bytes = 0;
+    while (file.good()) {
+        getline(file, line);
+        bytes += line.size() + 1;
+        if (line != "")
+            originalFile.push_back(line);
     }
-    if (node->left != nullptr)
-        postOrder(node->left);
-    if (node->right != nullptr)
-        postOrder(node->right);
-    
-    DisplayBid(node->bid);
+    if (originalFile.size() == 0)
+        throw csv::Error(string("No Data in ").append(csvPath));
+
+    vector<string> header;
+    stringstream ss(originalFile[0]);
+    string item;
+    while (getline(ss, item, ','))
+        header.push_back(item);
+
+    vector<csv::Row*> content;
+    for (auto it = originalFile.begin() + 1; it != originalFile.end(); it++) {
+        bool quoted = false;
+        int tokenStart = 0;
+        csv::Row* row = new csv::Row(header);
+        for (unsigned int i = 0; i != it->length(); i++) {
+            if (it->at(i) == '"')
+                quoted = !quoted;
+            else if (it->at(i) == ',' && !quoted) {
+                row->push(it->substr(tokenStart, i - tokenStart));
+                tokenStart = i + 1;
+            }
+        }
+        row->push(it->substr(tokenStart, it->length() - tokenStart));
+        bool corrupted = row->size() != header.size();
+        content.push_back(row);
+        if (corrupted) {
+            for (csv::Row* parsed : content)
+                delete parsed;
+            throw csv::Error("corrupted data !");
+        }
+    }
+
+    size_t rows = content.size();
+    for (csv::Row* parsed : content)
+        delete parsed;
+    return rows;
 }
+
 /**
- * Pre-order tree traversal (recursive)
+ * Compare csv::Parser with its previous line-based code path on one file
  *
- *@param node Current node in tree
+ * @param csvPath The file to parse
+ * @param repeats Number of times each parser runs
  */
-void BinarySearchTree::preOrder(Node* node) {
-    if (node == nullptr) {
-        cout << "Tree is empty" << endl;
+void csvParserBenchmark(string csvPath, int repeats) {
+    size_t bytes = 0;
+    size_t baselineRows = 0;
+    string baselineError;
+    clock_t ticks = clock();
+    try {
+        for (int run = 0; run < repeats; run++)
+            baselineRows = baselineCsvParse(csvPath, bytes);
+    } catch (csv::Error &e) {
+        baselineError = e.what();
+    }
+    double baselineSeconds = (clock() - ticks) * 1.0 / CLOCKS_PER_SEC / repeats;
+    double megabytes = bytes / 1048576.0;
+
+    size_t parserRows = 0;
+    ticks = clock();
+    try {
+        for (int run = 0; run < repeats; run++) {
+            csv::Parser file(csvPath, csv::eFILE, ',', [](unsigned int, const string&) { return true; });
+            parserRows = file.rowCount();
+        }
+    } catch (csv::Error &e) {
+        std::cerr << e.what() << std::endl;
         return;
     }
-    
-    DisplayBid(node->bid);
-    
-    if (node->left != nullptr)
-        preOrder(node->left);
-    if (node->right != nullptr)
-        preOrder(node->right);
+    double parserSeconds = (clock() - ticks) * 1.0 / CLOCKS_PER_SEC / repeats;
+
+    if (baselineError.empty())
+        cout << "previous csv::Parser: " << baselineRows << " rows, " << baselineSeconds << " seconds ("
+                << megabytes / max(baselineSeconds, 1e-9) << " MB/s)" << endl;
+    else
+        cout << "previous csv::Parser: rejects this file (" << baselineError << ")" << endl;
+    cout << "csv::Parser: " << parserRows << " rows, " << parserSeconds << " seconds ("
+            << megabytes / max(parserSeconds, 1e-9) << " MB/s)" << endl;
 }
 
 /**
- * Get parent node
+ * Bulk load the same file into sharded trees with 1, 2, 4, ... shards
+ *
+ * Reports the batch insert time for each shard count and its speedup
+ * over a single shard; parsing is excluded, since it is the same for all.
  *
- *@param node Pointer to the node whose parent is ascertained
+ * @param csvPath The file to load
  */
-Node* BinarySearchTree::getParent(Node* subTreeRoot, Node* node) {
-    if (subTreeRoot == nullptr)
-        return nullptr;
-     
-    if (subTreeRoot->left == node || subTreeRoot->right == node)
-        return subTreeRoot;
-
-    if (node->bid.bidId < subTreeRoot->bid.bidId)
-        return getParent(subTreeRoot->left, node);
-    return getParent(subTreeRoot->right, node);
+void shardedLoadBenchmark(string csvPath) {
+    int cores = max(2, (int) thread::hardware_concurrency());
+    double single = 0.0;
+    for (int shardCount = 1; shardCount <= cores; shardCount *= 2) {
+        ShardedBinarySearchTree tree(shardCount);
+        double seconds = loadBids(csvPath, &tree);
+        if (shardCount == 1)
+            single = seconds;
+        cout << shardCount << " shards: " << tree.GetSize() << " bids in " << seconds << " seconds ("
+                << tree.GetSize() / max(seconds, 1e-9) << " bids/s, "
+                << single / max(seconds, 1e-9) << "x over 1 shard)" << endl;
+    }
+    cout << thread::hardware_concurrency() << " hardware threads" << endl;
 }
+
 /**
- * Removes node with bidId equal to string parameter (recursive)
+ * Time tearing down a large tree serially and with DestroyParallel
  *
- *@param node The node to be deleted
- *@param parent The parent of the node to be deleted
- *
- * Credit: ZYBooks CS300: Data Structures and Algorithms
-*/
-Node* BinarySearchTree::removeNode(Node* parent, Node* node) {
-    /// Avoid program crash in case root node is null
-    string bidId = node->bid.bidId;
-    if (node == nullptr) {
-        cout << endl << "Bid " << bidId << " not found." << endl;
-        return node;
-    }
-    /// Node matches, remove node
-    /// Node to be deleted has two children
-    if (node->left != nullptr && node->right != nullptr) {
-        Node* succNode = node->right;
-        Node* successorParent = node;
-        while (succNode->left != nullptr) {
-            successorParent = succNode;
-            succNode = succNode->left;
+ * @param bidCount Number of bids in each tree
+ * @param threadCount Threads for DestroyParallel
+ */
+void teardownBenchmark(int bidCount, int threadCount) {
+    for (int parallel = 0; parallel < 2; parallel++) {
+        BinarySearchTree* bst = new BinarySearchTree();
+        srand(1);
+        for (int i = 0; i < bidCount; i++) {
+            Bid bid;
+            bid.bidId = to_string(((unsigned long)rand() << 20) ^ i);
+            bid.title = "teardown bid title " + to_string(i);
+            bid.fund = "fund";
+            bst->Insert(bid);
         }
-        node->bid = succNode->bid;
-        node->right = removeNode(successorParent, succNode);
-    }
-    /// Root node with 1 or 0 children
-    else if (node == root) {
-        if (node->left != nullptr)
-            root = node->left;
-        else
-            root = node->right;
-    }
-    /// Internal node with left child only
-    else if (node->left != nullptr) {
-        /// Replace node with node's left child
-        if (parent->left == node)
-            parent->left = node->left;
-        else
-            parent->right = node->left;
-    }
-    /// Leaf or internal node with right child only
-    else {
-        /// Replace node with node's right child
-        if (parent->left == node)
-            parent->left = node->right;
-        else
-            parent->right = node->right;
+
+        auto started = chrono::steady_clock::now();
+        if (parallel)
+            bst->DestroyParallel(threadCount);
+        delete bst;
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        cout << (parallel ? "parallel (" + to_string(threadCount) + " threads)" : string("serial"))
+                << ": " << bidCount << " bids freed in " << seconds << " seconds" << endl;
     }
-    return nullptr;
 }
 
-//============================================================================
-// Static methods used for testing
-//============================================================================
-
 /**
- * Load a CSV file containing bids into a container
+ * Compare the heap footprint of the node tree and the columnar tree
  *
- * @param csvPath the path to the CSV file to load
- * return a container holding all the bids read
+ * Loads the same file into each and reports the heap bytes per bid, then
+ * churns the columnar tree (remove a random bid, insert it again under a
+ * new bidId) to show that released rows are reused instead of growing
+ * the store.
+ *
+ * @param csvPath The file to load
+ * @param rounds Number of churn rounds, each touching every bid once
  */
-void loadBids(string csvPath, BinarySearchTree* bst) {
-    cout << "Loading CSV file " << csvPath << endl;
+void storageBenchmark(string csvPath, int rounds) {
+    size_t before = heapBytesInUse();
+    BinarySearchTree* nodeTree = new BinarySearchTree();
+    loadBids(csvPath, nodeTree);
+    double nodeBytes = (double) heapBytesInUse() - before;
+    int nodeCount = nodeTree->GetSize();
+    delete nodeTree;
 
-    // initialize the CSV Parser using the given path
-    csv::Parser file = csv::Parser(csvPath);
-
-    // read and display header row - optional
-    vector<string> header = file.getHeader();
-    for (auto const& c : header) {
-        cout << c << " | ";
+    before = heapBytesInUse();
+    ColumnarBinarySearchTree* columnTree = new ColumnarBinarySearchTree();
+    loadBids(csvPath, columnTree);
+    double columnBytes = (double) heapBytesInUse() - before;
+    int columnCount = columnTree->GetSize();
+    if (nodeCount == 0 || columnCount == 0) {
+        cout << "No bids loaded" << endl;
+        delete columnTree;
+        return;
     }
-    cout << "" << endl;
 
-    try {
-        // loop to read rows of a CSV file
-        for (unsigned int i = 0; i < file.rowCount(); i++) {
-
-            // Create a data structure and add to the collection of bids
-            Bid bid;
-            bid.bidId = file[i][1];
-            bid.title = file[i][0];
-            bid.fund = file[i][8];
-            bid.amount = strToDouble(file[i][4], '$');
+    cout << "node tree: " << nodeCount << " bids, " << (long) nodeBytes << " bytes ("
+            << nodeBytes / nodeCount << " per bid)" << endl;
+    cout << "columnar tree: " << columnCount << " bids, " << (long) columnBytes << " bytes ("
+            << columnBytes / columnCount << " per bid)" << endl;
+    cout << "columnar saving: " << nodeBytes / max(columnBytes, 1.0) << "x" << endl;
 
-            //cout << "Item: " << bid.title << ", Fund: " << bid.fund << ", Amount: " << bid.amount << endl;
+    CollectingSink loaded;
+    columnTree->InOrder(loaded);
+    vector<string> liveIds;
+    for (auto const& bid : loaded.bids)
+        liveIds.push_back(bid.bidId);
+    loaded.bids.clear();
+    loaded.bids.shrink_to_fit();
 
-            // push this bid to the end
-            bst->Insert(bid);
+    unsigned long nextId = 0;
+    srand(1);
+    for (int round = 1; round <= rounds; round++) {
+        for (size_t i = 0; i < liveIds.size(); i++) {
+            size_t victim = rand() % liveIds.size();
+            Bid bid;
+            columnTree->Search(liveIds[victim], bid);
+            columnTree->Remove(liveIds[victim]);
+            bid.bidId = "churn" + to_string(nextId++);
+            columnTree->Insert(bid);
+            liveIds[victim] = bid.bidId;
         }
-    } catch (csv::Error &e) {
-        std::cerr << e.what() << std::endl;
+        cout << "round " << round << ": " << columnTree->GetSize() << " bids, "
+                << columnTree->GetStore().RowCount() << " rows ("
+                << summarizeStore(columnTree->GetStore()).count << " live), "
+                << heapBytesInUse() << " heap bytes" << endl;
     }
-}
 
-/**
- * Simple C function to convert a string to a double
- * after stripping out unwanted char
- *
- * credit: http://stackoverflow.com/a/24875936
- *
- * @param ch The character to strip out
- */
-double strToDouble(string str, char ch) {
-    str.erase(remove(str.begin(), str.end(), ch), str.end());
-    return atof(str.c_str());
+    delete columnTree;
 }
 
 /**
@@ -419,6 +3918,34 @@ double strToDouble(string str, char ch) {
  */
 int main(int argc, char* argv[]) {
 
+    // scripted self check: --self-check [seed] [operations], exits non-zero on failure
+    if (argc >= 2 && string(argv[1]) == "--self-check") {
+        unsigned long seed = time(nullptr);
+        long operations = 200000;
+        char* end = nullptr;
+        if (argc >= 3) {
+            errno = 0;
+            seed = strtoul(argv[2], &end, 10);
+            if (*argv[2] == '\0' || *argv[2] == '-' || *end != '\0' || errno != 0 || seed > numeric_limits<unsigned int>::max()) {
+                std::cerr << "bad seed: " << argv[2] << std::endl;
+                return 2;
+            }
+        }
+        if (argc >= 4) {
+            errno = 0;
+            operations = strtol(argv[3], &end, 10);
+            if (*argv[3] == '\0' || *end != '\0' || errno != 0 || operations < 1 || operations > numeric_limits<int>::max()) {
+                std::cerr << "bad operation count: " << argv[3] << std::endl;
+                return 2;
+            }
+        }
+        if (argc > 4) {
+            std::cerr << "usage: " << argv[0] << " --self-check [seed] [operations]" << std::endl;
+            return 2;
+        }
+        return selfCheck(operations, seed) ? 0 : 1;
+    }
+
     // process command line arguments
     string csvPath, bidKey;
     switch (argc) {
@@ -437,13 +3964,17 @@ int main(int argc, char* argv[]) {
 
     // Define a timer variable
     clock_t ticks;
+    chrono::steady_clock::time_point loadStart;
 
     // Define a binary search tree to hold all bids
     BinarySearchTree* bst;
     bst = new BinarySearchTree();
+    bst->EnableIndex();
     Bid bid;
     Node* node;
     string lavatory;
+    string exportPath;
+    string highKey;
     
     int choice = -1;
     while (choice != 9) {
@@ -452,10 +3983,14 @@ int main(int argc, char* argv[]) {
         cout << "  2. Display All Bids" << endl;
         cout << "  3. Find Bid" << endl;
         cout << "  4. Remove Bid" << endl;
+        cout << "  5. Benchmarks" << endl;
+        cout << "  6. Amount Summary" << endl;
+        cout << "  7. Export Bids" << endl;
+        cout << "  8. Self Check" << endl;
         cout << "  9. Exit" << endl;
         cout << "Enter choice: ";
         cin >> choice;
-        if (cin.fail() || (choice != 1 && choice != 2 && choice != 3 && choice != 4 && choice != 9)) {
+        if (cin.fail() || (choice != 1 && choice != 2 && choice != 3 && choice != 4 && choice != 5 && choice != 6 && choice != 7 && choice != 8 && choice != 9)) {
             cout << "Bad input." << endl;
             cin.clear();
             getline(cin, lavatory);
@@ -465,18 +4000,17 @@ int main(int argc, char* argv[]) {
 
         case 1:
             
-            // Initialize a timer variable before loading bids
-            ticks = clock();
+            // Wall time rather than clock(), which adds up the CPU time of every pipeline thread
+            loadStart = chrono::steady_clock::now();
 
             // Complete the method call to load the bids
-            loadBids(csvPath, bst);
+            loadBidsPipelined(csvPath, bst, max(1, (int) thread::hardware_concurrency() - 1));
 
             cout << bst->GetSize() << " bids read" << endl;
 
             // Calculate elapsed time and display result
-            ticks = clock() - ticks; // current clock ticks minus starting clock ticks
-            cout << "time: " << ticks << " clock ticks" << endl;
-            cout << "time: " << ticks * 1.0 / CLOCKS_PER_SEC << " seconds" << endl;
+            cout << "time: " << chrono::duration<double>(chrono::steady_clock::now() - loadStart).count()
+                    << " seconds" << endl;
             break;
 
         case 2:
@@ -529,7 +4063,105 @@ int main(int argc, char* argv[]) {
 
         case 4:
             cin >> bidKey;
-            bst->Remove(bidKey);
+            if (bst->Remove(bidKey))
+                cout << bidKey << " removed." << endl;
+            else
+                cout << bidKey << " not found." << endl;
+            break;
+
+        case 5:
+            choice = -1;
+            while (choice != 1 && choice != 2 && choice != 3 && choice != 4 && choice != 5) {
+                cout << "Benchmarks:" << endl;
+                cout << " 1. Insert/remove churn" << endl;
+                cout << " 2. CSV parser" << endl;
+                cout << " 3. Columnar storage" << endl;
+                cout << " 4. Sharded bulk load" << endl;
+                cout << " 5. Tree teardown" << endl;
+                cin >> choice;
+                if (cin.fail() || (choice != 1 && choice != 2 && choice != 3 && choice != 4 && choice != 5)) {
+                    cout << "Bad input." << endl;
+                    cin.clear();
+                    getline(cin, lavatory);
+                    continue;
+                }
+                switch (choice) {
+
+                case 1:
+                    churnBenchmark(100000, 20);
+                    break;
+                case 2:
+                    csvParserBenchmark(csvPath, 5);
+                    break;
+                case 3:
+                    storageBenchmark(csvPath, 5);
+                    break;
+                case 4:
+                    shardedLoadBenchmark(csvPath);
+                    break;
+                case 5:
+                    teardownBenchmark(1000000, max(2, (int) thread::hardware_concurrency()));
+                    break;
+                }
+            }
+            break;
+
+        case 6:
+            choice = -1;
+            while (choice != 1 && choice != 2) {
+                cout << "Amount Summary:" << endl;
+                cout << " 1. All bids" << endl;
+                cout << " 2. BidId range" << endl;
+                cin >> choice;
+                if (cin.fail() || (choice != 1 && choice != 2)) {
+                    cout << "Bad input." << endl;
+                    cin.clear();
+                    getline(cin, lavatory);
+                    continue;
+                }
+                switch (choice) {
+
+                case 1:
+                    displayAmountReport(bst->SummarizeAmounts(10));
+                    break;
+                case 2:
+                    cout << "From bidId: ";
+                    cin >> bidKey;
+                    cout << "To bidId: ";
+                    cin >> highKey;
+                    displayAmountReport(bst->SummarizeAmounts(bidKey, highKey, 10));
+                    break;
+                }
+            }
+            break;
+
+        case 7:
+            choice = -1;
+            while (choice != 1 && choice != 2 && choice != 3) {
+                cout << "Export Bids:" << endl;
+                cout << " 1. CSV" << endl;
+                cout << " 2. Pipe-delimited" << endl;
+                cout << " 3. JSON lines" << endl;
+                cin >> choice;
+                if (cin.fail() || (choice != 1 && choice != 2 && choice != 3)) {
+                    cout << "Bad input." << endl;
+                    cin.clear();
+                    getline(cin, lavatory);
+                    continue;
+                }
+            }
+            cout << "File: ";
+            cin >> exportPath;
+
+            // Wall time, since the export formats on several threads
+            loadStart = chrono::steady_clock::now();
+            exportBids(bst, exportPath, choice == 1 ? eCSV : (choice == 2 ? ePIPE : eJSON));
+            cout << "time: " << chrono::duration<double>(chrono::steady_clock::now() - loadStart).count()
+                    << " seconds" << endl;
+            break;
+
+        case 8:
+            selfCheck(200000, time(nullptr));
             break;
         }
     }
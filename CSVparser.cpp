@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <sstream>
 #include <iomanip>
@@ -5,44 +7,35 @@
 
 namespace csv {
 
-  Parser::Parser(const std::string &data, const DataType &type, char sep)
-    : _type(type), _sep(sep)
+  Parser::Parser(const std::string &data, const DataType &type, char sep, const ErrorHandler &onError)
+    : _type(type), _sep(sep), _onError(onError)
   {
-      std::string line;
       if (type == eFILE)
       {
         _file = data;
-        std::ifstream ifile(_file.c_str());
+        std::ifstream ifile(_file.c_str(), std::ios::in | std::ios::binary);
         if (ifile.is_open())
         {
-            while (ifile.good())
-            {
-                getline(ifile, line);
-                if (line != "")
-                    _originalFile.push_back(line);
-            }
+            // read the whole file in one go, the tokenizer makes a single pass over it;
+            // chunked rather than sized up front so pipes work too
+            std::string content;
+            char chunk[1 << 16];
+            while (ifile.read(chunk, sizeof(chunk)) || ifile.gcount() > 0)
+              content.append(chunk, ifile.gcount());
             ifile.close();
 
-            if (_originalFile.size() == 0)
+            parseContent(content);
+            if (_header.size() == 0)
               throw Error(std::string("No Data in ").append(_file));
-            
-            parseHeader();
-            parseContent();
         }
         else
             throw Error(std::string("Failed to open ").append(_file));
       }
       else
       {
-        std::istringstream stream(data);
-        while (std::getline(stream, line))
-          if (line != "")
-            _originalFile.push_back(line);
-        if (_originalFile.size() == 0)
+        parseContent(data);
+        if (_header.size() == 0)
           throw Error(std::string("No Data in pure content"));
-
-        parseHeader();
-        parseContent();
       }
   }
 
@@ -54,51 +47,166 @@ namespace csv {
           delete *it;
   }
 
-  void Parser::parseHeader(void)
+  /*
+  ** RFC 4180 tokenizer: one pass over the bytes, fields split on _sep,
+  ** records on \n or \r\n. A quoted field may hold the separator, line
+  ** breaks and "" for a literal quote; the quotes themselves are dropped.
+  ** The first record is the header, empty lines are skipped, and rows that
+  ** don't match the header go through reject().
+  */
+  void Parser::parseContent(const std::string &data)
   {
-      std::stringstream ss(_originalFile[0]);
-      std::string item;
+     const char *bytes = data.data();
+     const size_t length = data.size();
+     std::vector<std::string> fields;
+     size_t i = 0;
+     unsigned int line = 1;
 
-      while (std::getline(ss, item, _sep))
-          _header.push_back(item);
-  }
+     while (i < length)
+     {
+         unsigned int recordLine = line;
+         std::string problem;
+         bool quotedAny = false;
+         fields.clear();
 
-  void Parser::parseContent(void)
-  {
-     std::vector<std::string>::iterator it;
-     
-     it = _originalFile.begin();
-     it++; // skip header
+         for (;;)
+         {
+             fields.push_back(std::string());
+             std::string &field = fields.back();
+
+             if (i < length && bytes[i] == '"')
+             {
+                 // quoted field: copy runs between quotes, "" is a literal quote
+                 quotedAny = true;
+                 i++;
+                 bool closed = false;
+                 while (i < length)
+                 {
+                     const char *quote = static_cast<const char *>(memchr(bytes + i, '"', length - i));
+                     size_t stop = quote ? quote - bytes : length;
+                     field.append(bytes + i, stop - i);
+                     line += std::count(bytes + i, bytes + stop, '\n');
+                     i = stop;
+                     if (i == length)
+                         break;
+                     i++;
+                     if (i < length && bytes[i] == '"')
+                     {
+                         field.push_back('"');
+                         i++;
+                         continue;
+                     }
+                     closed = true;
+                     break;
+                 }
+                 if (!closed)
+                     problem = "unterminated quoted field";
+                 else
+                 {
+                     // \r\n, or a bare \r at the end of the input
+                     if (i < length && bytes[i] == '\r' && (i + 1 == length || bytes[i + 1] == '\n'))
+                         i++;
+                     if (i < length && bytes[i] != _sep && bytes[i] != '\n')
+                     {
+                         problem = "unexpected character after quoted field";
+                         while (i < length && bytes[i] != '\n')
+                             i++;
+                     }
+                 }
+             }
+             else
+             {
+                 // unquoted field: runs to the next separator or line break
+                 size_t start = i;
+                 while (i < length && bytes[i] != _sep && bytes[i] != '\n')
+                     i++;
+                 size_t stop = i;
+                 if (stop > start && bytes[stop - 1] == '\r' && (i == length || bytes[i] == '\n'))
+                     stop--;
+                 field.assign(bytes + start, stop - start);
+             }
+
+             if (i < length && bytes[i] == _sep)
+             {
+                 i++;
+                 // a separator at the very end still opens one last, empty field
+                 if (i == length)
+                     fields.push_back(std::string());
+                 else
+                     continue;
+             }
+             break;
+         }
 
-     for (; it != _originalFile.end(); it++)
-     {
-         bool quoted = false;
-         int tokenStart = 0;
-         unsigned int i = 0;
+         // end of record
+         if (i < length && bytes[i] == '\n')
+         {
+             i++;
+             line++;
+         }
 
-         Row *row = new Row(_header);
+         // skip empty lines
+         if (fields.size() == 1 && fields[0].empty() && !quotedAny)
+             continue;
 
-         for (; i != it->length(); i++)
+         if (problem.empty() && _header.size() != 0 && fields.size() != _header.size())
+             problem = "corrupted data !";
+         if (!problem.empty())
          {
-              if (it->at(i) == '"')
-                  quoted = ((quoted) ? (false) : (true));
-              else if (it->at(i) == ',' && !quoted)
-              {
-                  row->push(it->substr(tokenStart, i - tokenStart));
-                  tokenStart = i + 1;
-              }
+             // a bad header is never skipped, the next row would take its place
+             if (_header.size() == 0 || !reject(recordLine, problem))
+                 throw Error(problem);
+             continue;
          }
 
-         //end
-         row->push(it->substr(tokenStart, it->length() - tokenStart));
+         if (_header.size() == 0)
+         {
+             _header.swap(fields);
+             continue;
+         }
 
-         // if value(s) missing
-         if (row->size() != _header.size())
-          throw Error("corrupted data !");
+         Row *row = new Row(_header);
+         for (std::vector<std::string>::iterator it = fields.begin(); it != fields.end(); it++)
+             row->push(std::move(*it));
          _content.push_back(row);
      }
   }
 
+  /*
+  ** Hand a malformed row to the error handler. Returns true if it should be
+  ** skipped; otherwise frees the rows parsed so far, since the destructor
+  ** won't run when the constructor throws.
+  */
+  bool Parser::reject(unsigned int line, const std::string &reason)
+  {
+      if (_onError && _onError(line, reason))
+          return true;
+
+      for (std::vector<Row *>::iterator it = _content.begin(); it != _content.end(); it++)
+          delete *it;
+      _content.clear();
+      return false;
+  }
+
+  /*
+  ** Quote a value for output if it holds the separator, a quote or a line break
+  */
+  std::string Parser::quote(const std::string &value) const
+  {
+      if (value.find(_sep) == std::string::npos && value.find_first_of("\"\r\n") == std::string::npos)
+          return value;
+
+      std::string quoted("\"");
+      for (std::string::const_iterator it = value.begin(); it != value.end(); it++)
+      {
+          if (*it == '"')
+              quoted.push_back('"');
+          quoted.push_back(*it);
+      }
+      quoted.push_back('"');
+      return quoted;
+  }
+
   Row &Parser::getRow(unsigned int rowPosition) const
   {
       if (rowPosition < _content.size())
@@ -170,16 +278,25 @@ namespace csv {
       unsigned int i = 0;
       for (auto it = _header.begin(); it != _header.end(); it++)
       {
-        f << *it;
+        f << quote(*it);
         if (i < _header.size() - 1)
-          f << ",";
+          f << _sep;
         else
           f << std::endl;
         i++;
       }
      
+      // rows, quoted so that they parse back to the same values
       for (auto it = _content.begin(); it != _content.end(); it++)
-        f << **it << std::endl;
+      {
+        for (unsigned int j = 0; j != (*it)->size(); j++)
+        {
+          if (j != 0)
+            f << _sep;
+          f << quote((**it)[j]);
+        }
+        f << std::endl;
+      }
       f.close();
     }
   }
@@ -208,6 +325,11 @@ namespace csv {
     _values.push_back(value);
   }
 
+  void Row::push(std::string &&value)
+  {
+    _values.push_back(std::move(value));
+  }
+
   bool Row::set(const std::string &key, const std::string &value) 
   {
     std::vector<std::string>::const_iterator it;
@@ -266,3 +388,28 @@ namespace csv {
     return os;
   }
 }
+
+#ifdef CSVPARSER_FUZZ
+# include <cstdint>
+
+/*
+** libFuzzer entry point for pure content parsing, built with
+**   clang++ -g -fsanitize=fuzzer,address -DCSVPARSER_FUZZ CSVparser.cpp
+** Any input may be rejected with csv::Error; anything else is a bug.
+*/
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    try
+    {
+        csv::Parser parser(std::string(reinterpret_cast<const char *>(data), size), csv::ePURE);
+
+        for (unsigned int i = 0; i != parser.rowCount(); i++)
+          for (unsigned int j = 0; j != parser[i].size(); j++)
+            parser[i][j];
+    }
+    catch (csv::Error &e)
+    {
+    }
+    return 0;
+}
+#endif
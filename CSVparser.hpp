@@ -1,6 +1,7 @@
 #ifndef     _CSVPARSER_HPP_
 # define    _CSVPARSER_HPP_
 
+# include <functional>
 # include <stdexcept>
 # include <string>
 # include <vector>
@@ -28,6 +29,7 @@ namespace csv
     	public:
             unsigned int size(void) const;
             void push(const std::string &);
+            void push(std::string &&);
             bool set(const std::string &, const std::string &); 
 
     	private:
@@ -60,11 +62,16 @@ namespace csv
         ePURE = 1
     };
 
+    // Called with the line number and a reason for each malformed row.
+    // Return true to skip the row and carry on, false to abort with csv::Error.
+    typedef std::function<bool (unsigned int, const std::string &)> ErrorHandler;
+
     class Parser
     {
 
     public:
-        Parser(const std::string &, const DataType &type = eFILE, char sep = ',');
+        Parser(const std::string &, const DataType &type = eFILE, char sep = ',',
+               const ErrorHandler &onError = ErrorHandler());
         ~Parser(void);
 
     public:
@@ -81,14 +88,15 @@ namespace csv
         void sync(void) const;
 
     protected:
-    	void parseHeader(void);
-    	void parseContent(void);
+    	void parseContent(const std::string &);
+    	bool reject(unsigned int, const std::string &);
+    	std::string quote(const std::string &) const;
 
     private:
         std::string _file;
         const DataType _type;
         const char _sep;
-        std::vector<std::string> _originalFile;
+        ErrorHandler _onError;
         std::vector<std::string> _header;
         std::vector<Row *> _content;
 